@@ -0,0 +1,69 @@
+#!/bin/sh
+# Checks that --max-steps lets a program run exactly N instructions, and
+# that a dictionary is still usable after --max-memory stopped an insert.
+#
+#     bench/check_limits.sh FLOW
+#
+# Each step case is a program and the number of instructions it takes to
+# the end (its HALT included). With --max-steps at that number the program
+# must finish (status 0); one fewer must stop it (status 3). The loop case
+# crosses several of the 4096-instruction spans between limit checks.
+#
+# The memory case grows a dictionary in the REPL until --max-memory stops
+# it, then reads the dictionary in a later entry, which keeps it alive. A
+# half-done insert shows up reliably with a flow built with
+# -fsanitize=address.
+
+if [ $# -ne 1 ]; then
+    sed -n '5s/^# */Usage: /p' "$0" >&2
+    exit 2
+fi
+flow=$1
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+printf 'print 1\n' > "$work/print.flow"
+cat > "$work/loop.flow" <<'EOF'
+let total = 0
+loop from i = 1 to 3000 ->
+    let total = total + i
+<-
+print total
+EOF
+
+failed=0
+
+# Status of a run; the program's own output is dropped
+status_of() {
+    "$flow" --max-steps "$1" "$2" > /dev/null 2>&1 < /dev/null
+    echo $?
+}
+
+check() {
+    program=$work/$1
+    steps=$2
+    got=$(status_of "$steps" "$program")
+    if [ "$got" != 0 ]; then
+        echo "$1 with --max-steps $steps: status $got, expected 0" >&2
+        failed=1
+    fi
+    got=$(status_of $((steps - 1)) "$program")
+    if [ "$got" != 3 ]; then
+        echo "$1 with --max-steps $((steps - 1)): status $got, expected 3" >&2
+        failed=1
+    fi
+}
+
+check print.flow 3
+check loop.flow 21009
+
+got=$(printf '%s\n' 'let d = {}' 'let i = 0' 'loop while 1 ->' '  let d[i] = i' '  let i = i + 1' '<-' \
+      'print d[5]' 'print len(d) == i' | "$flow" --repl --max-memory 1 2> /dev/null | tr '\n' ' ')
+if [ "$got" != "5 1 " ]; then
+    echo "dictionary after --max-memory: printed '$got', expected '5 1 '" >&2
+    failed=1
+fi
+
+[ $failed = 0 ] && echo "limits ok"
+exit $failed
@@ -0,0 +1,75 @@
+#!/bin/sh
+# Checks that a REPL session saved with :save prints, when run as a file,
+# what it printed while it was typed.
+#
+#     bench/check_repl.sh FLOW
+#
+# The session has entries that must be left out: a syntax error, a call to
+# a procedure that does not exist, a call with too many arguments, and a
+# second define of a procedure (which a file does not allow either).
+#
+# It also has a procedure that assigns a name the main program uses first
+# after a call, the case the README says runs differently: that call sets
+# a local and later ones the global, where in the saved file every call
+# sets the global.
+
+if [ $# -ne 1 ]; then
+    sed -n '5s/^# */Usage: /p' "$0" >&2
+    exit 2
+fi
+flow=$1
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cat > "$work/session.txt" <<EOF
+let x = 5
+print x +
+define twice(a) ->
+    return a * 2
+<-
+print call twice(4)
+define twice(a) ->
+    return a * 3
+<-
+print call twice(4)
+print call twice(1, 2)
+call missing()
+let x = x + 1
+print x
+define setup() ->
+    let total = 5
+<-
+call setup()
+print total
+call setup()
+print total
+define reset() ->
+    let count = 2
+<-
+let count = 1
+call reset()
+print count
+:save $work/saved.flow
+EOF
+
+failed=0
+
+expect() {
+    if [ "$2" != "$3" ]; then
+        echo "$1 printed '$2', expected '$3'" >&2
+        failed=1
+    fi
+}
+
+typed=$("$flow" --repl < "$work/session.txt" 2> "$work/problems" | tr '\n' ' ')
+expect session "$typed" "8 8 6 0 5 2 "
+if ! grep -q '^setup now uses the global total;' "$work/problems"; then
+    echo "the session did not say that setup now uses the global total" >&2
+    failed=1
+fi
+saved=$("$flow" "$work/saved.flow" 2> /dev/null < /dev/null | tr '\n' ' ')
+expect "saved session" "$saved" "8 8 6 5 5 2 "
+
+[ $failed = 0 ] && echo "repl ok"
+exit $failed
@@ -0,0 +1,113 @@
+// Whole-array kernels: checks that every version gives the scalar results,
+// then times each version.
+//
+// Every kernel of every version this CPU can run is compared bit for bit with
+// the scalar one, over all sizes up to 67 and a few large ones, on plain
+// numbers and on arrays holding NaN, infinities and both signs of zero.
+//
+// Build and run from the repository root:
+//     g++ -std=c++17 -O2 bench/kernels_bench.cpp -o kernels_bench && ./kernels_bench
+
+#define FLOW_NO_MAIN
+#include "../flow.cpp"
+
+#include <chrono>
+#include <cmath>
+#include <random>
+
+static volatile double sinkNumber;
+
+static bool sameBits(double a, double b) { return memcmp(&a, &b, sizeof(double)) == 0; }
+
+static bool sameBits(const vector<double>& a, const vector<double>& b) {
+    return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(double)) == 0);
+}
+
+// n values of the given pattern: 0 plain, 1 NaN here and there (and first),
+// 2 zeros of both signs, 3 infinities and NaN
+static vector<double> pattern(int kind, size_t n, mt19937_64& random) {
+    uniform_real_distribution<double> number(-1000, 1000);
+    vector<double> x(n);
+    for (size_t i = 0; i < n; i++) {
+        x[i] = number(random);
+        unsigned pick = random() % 8;
+        if (kind == 1 && pick == 0) x[i] = NAN;
+        if (kind == 2 && pick < 3) x[i] = pick == 0 ? 0.0 : -0.0;
+        if (kind == 3 && pick == 0) x[i] = random() % 2 ? INFINITY : -INFINITY;
+        if (kind == 3 && pick == 1) x[i] = NAN;
+    }
+    if (kind == 1 && n > 0 && random() % 4 == 0) x[0] = NAN;
+    return x;
+}
+
+// Reports each difference from the scalar kernels; the number found
+static size_t compare(const ArrayKernels& kernels, const vector<double>& x, const vector<double>& y) {
+    const ArrayKernels& scalar = SCALAR_KERNELS;
+    size_t n = x.size(), wrong = 0;
+    auto report = [&](const char* what, bool same) {
+        if (!same) {
+            printf("%s %s differs from scalar for %zu element(s)\n", kernels.name, what, n);
+            wrong++;
+        }
+    };
+    report("sum", sameBits(kernels.sum(x.data(), n), scalar.sum(x.data(), n)));
+    report("dot", sameBits(kernels.dot(x.data(), y.data(), n), scalar.dot(x.data(), y.data(), n)));
+    if (n > 0) {
+        report("min", sameBits(kernels.min(x.data(), n), scalar.min(x.data(), n)));
+        report("max", sameBits(kernels.max(x.data(), n), scalar.max(x.data(), n)));
+    }
+    vector<double> got(n), expected(n);
+    kernels.clamp(got.data(), x.data(), -10, 10, n);
+    scalar.clamp(expected.data(), x.data(), -10, 10, n);
+    report("clamp", sameBits(got, expected));
+    for (Operator op : {OPR_ADD, OPR_SUB, OPR_MUL, OPR_DIV}) {
+        kernels.arith(op, got.data(), x.data(), y.data(), n);
+        scalar.arith(op, expected.data(), x.data(), y.data(), n);
+        report(operatorSymbol(op), sameBits(got, expected));
+        kernels.arithScalar(op, got.data(), x.data(), 3.5, true, n);
+        scalar.arithScalar(op, expected.data(), x.data(), 3.5, true, n);
+        report(operatorSymbol(op), sameBits(got, expected));
+    }
+    return wrong;
+}
+
+template <typename F>
+static double nsPerElement(size_t n, F body) {
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < 20; r++) body();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (20.0 * n);
+}
+
+int main() {
+    vector<const ArrayKernels*> versions = {&SCALAR_KERNELS};
+#ifdef FLOW_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) versions.push_back(&avx2_KERNELS);
+#endif
+
+    mt19937_64 random(1);
+    vector<size_t> sizes;
+    for (size_t n = 0; n <= 67; n++) sizes.push_back(n);
+    for (size_t n : {1000, 4099, 100003}) sizes.push_back(n);
+    size_t wrong = 0;
+    for (const ArrayKernels* kernels : versions) {
+        for (int kind = 0; kind < 4; kind++) {
+            for (size_t n : sizes) {
+                wrong += compare(*kernels, pattern(kind, n, random), pattern(kind, n, random));
+            }
+        }
+        // The case that once went wrong: a NaN in a lane hid the later minimum
+        wrong += compare(*kernels, {2, NAN, 3, 4, 1, 0}, {1, 1, 1, 1, 1, 1});
+    }
+
+    const size_t n = 1 << 20;
+    vector<double> x = pattern(0, n, random), y = pattern(0, n, random), out(n);
+    for (const ArrayKernels* kernels : versions) {
+        double sum = nsPerElement(n, [&] { sinkNumber = kernels->sum(x.data(), n); });
+        double extreme = nsPerElement(n, [&] { sinkNumber = kernels->min(x.data(), n); });
+        double arith = nsPerElement(n, [&] { kernels->arith(OPR_MUL, out.data(), x.data(), y.data(), n); });
+        printf("%-8s %8.3f ns/sum  %8.3f ns/min  %8.3f ns/mul   (per element)\n", kernels->name, sum, extreme, arith);
+    }
+    if (wrong > 0) printf("%zu result(s) differ from the scalar kernels\n", wrong);
+    return wrong > 0 ? 1 : 0;
+}
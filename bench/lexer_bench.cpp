@@ -0,0 +1,71 @@
+// Lexer throughput over a generated multi-megabyte script.
+//
+// Builds a script of ordinary Flow statements (keywords, names, numbers,
+// strings, comments and operators), then times the lexer alone and the
+// whole front end (lexing, parsing and compiling) over it.
+//
+// Build and run from the repository root:
+//     g++ -std=c++17 -O2 bench/lexer_bench.cpp -o lexer_bench && ./lexer_bench [megabytes]
+
+#define FLOW_NO_MAIN
+#include "../flow.cpp"
+
+#include <chrono>
+
+static volatile size_t sinkCount;
+
+// About `bytes` of source, the same every run
+static string generateScript(size_t bytes) {
+    string script;
+    script.reserve(bytes + 256);
+    for (size_t i = 0; script.size() < bytes; i++) {
+        string n = to_string(i);
+        script += "# step " + n + " of the generated script\n";
+        script += "let total_" + to_string(i % 97) + " = total_" + to_string(i % 89) + " * 3 + " + n + ".5 % 7\n";
+        script += "when total_" + to_string(i % 97) + " >= " + n + " ->\n";
+        script += "    print \"row \" + " + n + " + \" of many\"\n";
+        script += "<- otherwise ->\n";
+        script += "    let name = input(\"Name for " + n + ":\")\n";
+        script += "<-\n";
+        script += "loop from k = 1 to " + to_string(i % 50 + 1) + " ->\n";
+        script += "    let grid[k] = sqrt(pow(k, 2)) + abs(floor(k / 2)) - ceil(random(1, 6))\n";
+        script += "<-\n";
+        script += "label mark_" + n + "\n";
+    }
+    return script;
+}
+
+template <typename F>
+static double bestSeconds(int runs, F body) {
+    double best = 1e30;
+    for (int r = 0; r < runs; r++) {
+        auto start = chrono::steady_clock::now();
+        body();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    size_t megabytes = argc > 1 ? strtoul(argv[1], nullptr, 10) : 8;
+    string script = generateScript(megabytes << 20);
+    double mb = script.size() / 1048576.0;
+
+    size_t tokens = 0;
+    double lex = bestSeconds(5, [&] {
+        Lexer lexer(script);
+        tokens = lexer.tokenize().size();
+        sinkCount = tokens;
+    });
+
+    double front = bestSeconds(3, [&] {
+        ostringstream errors;
+        auto program = compileProgram(script, errors);
+        sinkCount = program->code.size();
+    });
+
+    printf("script   %8.1f MB  %10zu tokens\n", mb, tokens);
+    printf("lex      %8.1f MB/s  %8.1f M tokens/s\n", mb / lex, tokens / lex / 1e6);
+    printf("compile  %8.1f MB/s  (lex, parse and compile)\n", mb / front);
+    return 0;
+}
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Runs the bench/*.flow workloads and reports wall time per workload.
+#
+#     bench/run.sh [-n RUNS] [-t PERCENT] [-b BASELINE] FLOW [WORKLOAD.flow ...]
+#
+# Each workload runs RUNS times (default 10) and the median and 95th
+# percentile wall times are shown, with ops/sec from the "# ops: N" line at
+# the top of the workload. With -b, the BASELINE flow binary runs each
+# workload too (runs alternate between the two), both must print the same
+# output, and a workload whose median is more than PERCENT (default 5)
+# slower than the baseline is a regression: the script then exits 1.
+#
+# Example, comparing a change against the last commit:
+#     git stash && g++ -std=c++17 -O2 flow.cpp -o /tmp/flow-old && git stash pop
+#     g++ -std=c++17 -O2 flow.cpp -o flow
+#     bench/run.sh -b /tmp/flow-old ./flow
+
+runs=10
+threshold=5
+baseline=
+while getopts n:t:b: opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        t) threshold=$OPTARG ;;
+        b) baseline=$OPTARG ;;
+        *) sed -n '4s/^# */Usage: /p' "$0" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 1 ]; then
+    sed -n '4s/^# */Usage: /p' "$0" >&2
+    exit 2
+fi
+flow=$1
+shift
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/*.flow
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Wall time of one run in seconds; output goes to $2
+run_once() {
+    start=$(date +%s%N)
+    "$1" "$workload" > "$2" 2>&1 < /dev/null || echo "$1 failed on $workload" >&2
+    end=$(date +%s%N)
+    echo "$start $end" | awk '{ printf "%.6f\n", ($2 - $1) / 1e9 }'
+}
+
+# "median p95" of the times in file $1
+summarize() {
+    sort -n "$1" | awk '{ t[NR] = $1 } END {
+        median = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+        p95 = t[int(NR * 0.95 + 0.999999)]
+        print median, p95
+    }'
+}
+
+if [ -n "$baseline" ]; then
+    printf '%-18s %10s %10s %12s %10s %8s\n' workload median p95 ops/sec base-med change
+else
+    printf '%-18s %10s %10s %12s\n' workload median p95 ops/sec
+fi
+
+status=0
+for workload in "$@"; do
+    name=$(basename "$workload" .flow)
+    ops=$(sed -n 's/^# ops: *\([0-9]*\).*/\1/p' "$workload" | head -n 1)
+    : > "$work/new" ; : > "$work/old"
+    i=0
+    while [ $i -lt "$runs" ]; do
+        run_once "$flow" "$work/new.out" >> "$work/new"
+        [ -n "$baseline" ] && run_once "$baseline" "$work/old.out" >> "$work/old"
+        i=$((i + 1))
+    done
+
+    set -- $(summarize "$work/new")
+    median=$1 p95=$2
+    rate=$(echo "${ops:-0} $median" | awk '{ if ($1 > 0 && $2 > 0) printf "%.0f", $1 / $2; else print "-" }')
+    if [ -z "$baseline" ]; then
+        printf '%-18s %9.3fs %9.3fs %12s\n' "$name" "$median" "$p95" "$rate"
+        continue
+    fi
+
+    set -- $(summarize "$work/old")
+    change=$(echo "$median $1" | awk '{ printf "%+.1f%%", ($1 / $2 - 1) * 100 }')
+    note=
+    if ! cmp -s "$work/new.out" "$work/old.out"; then
+        note="  OUTPUT DIFFERS"
+        status=1
+    elif echo "$median $1 $threshold" | awk '{ exit !($1 > $2 * (1 + $3 / 100)) }'; then
+        note="  REGRESSION"
+        status=1
+    fi
+    printf '%-18s %9.3fs %9.3fs %12s %9.3fs %8s%s\n' "$name" "$median" "$p95" "$rate" "$1" "$change" "$note"
+done
+exit $status
@@ -0,0 +1,105 @@
+// Runs one compiled program on many interpreters at once.
+//
+// The program is compiled a single time and shared by every run; each run
+// has its own Interpreter with its output captured in memory. Every run's
+// output must match a run made on its own, and the runs per second show how
+// well the interpreters scale across threads. Interpreters that ran on
+// other threads are also destroyed on the main thread, which must leave the
+// main thread's memory count (--max-memory) as it was.
+//
+// Build and run from the repository root:
+//     g++ -std=c++17 -O2 -pthread bench/threads_bench.cpp -o threads_bench
+//     ./threads_bench [runs] [program.flow]      (default: 64 bench/procedures.flow)
+
+#define FLOW_NO_MAIN
+#include "../flow.cpp"
+
+#include <atomic>
+#include <thread>
+
+// One run with its own interpreter: the program's output, or "" on an error
+static string runOnce(const Bytecode& program) {
+    ostringstream output, errors;
+    Interpreter interpreter;
+    interpreter.setOutput(&output);
+    interpreter.setErrors(&errors);
+    interpreter.setSeed(1);
+    istringstream noInput;
+    interpreter.setInput(&noInput);
+    return interpreter.run(program) ? output.str() : "";
+}
+
+// Runs interpreters on worker threads and destroys them on this one; true
+// if this thread's count of heap bytes is unchanged afterwards
+static bool destroyElsewhere() {
+    // Long strings, an array and a dictionary: values with counted heap bodies
+    auto program = compileProgram("let s = \"a string too long to be stored inline\"\n"
+                                  "let a = [1, 2, s]\n"
+                                  "let d = {\"key\": s + \" and more\"}\n"
+                                  "print d[\"key\"]\n");
+    size_t before = heapBytes;
+    {
+        vector<ostringstream> outputs(4);
+        vector<unique_ptr<Interpreter>> interpreters;
+        for (auto& output : outputs) {
+            interpreters.push_back(make_unique<Interpreter>());
+            interpreters.back()->setOutput(&output);
+        }
+        vector<thread> pool;
+        for (auto& interpreter : interpreters) {
+            pool.emplace_back([&interpreter, &program] { interpreter->run(*program); });
+        }
+        for (auto& worker : pool) worker.join();
+    }
+    return heapBytes == before;
+}
+
+int main(int argc, char* argv[]) {
+    size_t runs = argc > 1 ? strtoul(argv[1], nullptr, 10) : 64;
+    string path = argc > 2 ? argv[2] : "bench/procedures.flow";
+    ifstream file(path);
+    if (!file) {
+        cerr << "Could not open file: " << path << endl;
+        return 1;
+    }
+    stringstream source;
+    source << file.rdbuf();
+
+    selectArrayKernels(true);
+    shared_ptr<const Bytecode> program = compileProgram(source.str());
+    string expected = runOnce(*program);
+    if (expected.empty()) {
+        cerr << path << " did not run cleanly on its own" << endl;
+        return 1;
+    }
+
+    // At least 4 threads, so sharing is exercised even on a small machine
+    size_t most = max(4u, thread::hardware_concurrency());
+    int status = 0;
+    if (!destroyElsewhere()) {
+        printf("interpreters destroyed on another thread changed its memory count\n");
+        status = 1;
+    }
+    for (size_t threads = 1; threads <= most; threads *= 2) {
+        atomic<size_t> next(0), wrong(0);
+        auto start = chrono::steady_clock::now();
+        vector<thread> pool;
+        for (size_t t = 0; t < threads; t++) {
+            pool.emplace_back([&] {
+                while (next++ < runs) {
+                    if (runOnce(*program) != expected) wrong++;
+                }
+            });
+        }
+        for (auto& worker : pool) worker.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        printf("%3zu thread(s)  %8.1f runs/sec", threads, runs / seconds);
+        if (wrong > 0) {
+            printf("  %zu run(s) gave different output", wrong.load());
+            status = 1;
+        }
+        printf("\n");
+    }
+    return status;
+}
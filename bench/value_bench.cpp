@@ -0,0 +1,86 @@
+// Microbenchmark for the interpreter's Value type.
+//
+// Compares the current tagged Value with the original layout (bool + double
+// + std::string in every instance) on the operations evalValue and the VM
+// perform most: numeric temporaries, variable reads and `let` stores.
+//
+// Build and run from the repository root:
+//     g++ -std=c++17 -O2 bench/value_bench.cpp -o value_bench && ./value_bench
+
+#define FLOW_NO_MAIN
+#include "../flow.cpp"
+
+#include <chrono>
+
+// The Value struct as it was before the tagged representation
+struct LegacyValue {
+    bool is_string;
+    double num_value;
+    string str_value;
+
+    LegacyValue() : is_string(false), num_value(0) {}
+    LegacyValue(double n) : is_string(false), num_value(n) {}
+    LegacyValue(string s) : is_string(true), num_value(0), str_value(s) {}
+};
+
+static double numberOf(const LegacyValue& v) { return v.num_value; }
+static double numberOf(const Value& v) { return v.number(); }
+static size_t lengthOf(const LegacyValue& v) { return v.str_value.size(); }
+static size_t lengthOf(const Value& v) { return v.text().size(); }
+
+static volatile double sinkNumber;
+static volatile size_t sinkLength;
+
+template <typename F>
+static double nsPerOp(size_t ops, F body) {
+    auto start = chrono::steady_clock::now();
+    body();
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(end - start).count() / ops;
+}
+
+template <typename V>
+static void runSuite(const char* name, size_t n) {
+    vector<V> vars(64, V(1.5));
+    vector<V> strs;
+    for (int i = 0; i < 64; i++) strs.push_back(V(string(i % 2 ? "short" : "a considerably longer string value")));
+
+    // let x = x + 1: two numeric temporaries and a store
+    double arith = nsPerOp(n, [&] {
+        for (size_t i = 0; i < n; i++) {
+            V left = vars[i & 63];
+            V right(1.0);
+            V result(numberOf(left) + numberOf(right));
+            vars[i & 63] = result;
+        }
+        sinkNumber = numberOf(vars[0]);
+    });
+
+    // reading a string variable onto the stack
+    double read = nsPerOp(n, [&] {
+        size_t total = 0;
+        for (size_t i = 0; i < n; i++) {
+            V copy = strs[i & 63];
+            total += lengthOf(copy);
+        }
+        sinkLength = total;
+    });
+
+    // let a = b where b holds a string
+    double store = nsPerOp(n, [&] {
+        for (size_t i = 0; i < n; i++) {
+            strs[i & 63] = strs[(i + 1) & 63];
+        }
+        sinkLength = lengthOf(strs[0]);
+    });
+
+    printf("%-8s %5zu bytes  %8.2f ns/arith  %8.2f ns/read  %8.2f ns/store\n",
+           name, sizeof(V), arith, read, store);
+}
+
+int main() {
+    const size_t n = 20000000;
+    runSuite<LegacyValue>("legacy", n);
+    runSuite<Value>("tagged", n);
+    return 0;
+}
@@ -10,38 +10,116 @@
 #include <ctime>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <string_view>
+#include <charconv>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstdint>
+#include <csignal>
+#include <sys/time.h>
+#include <chrono>
+#include <iomanip>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <atomic>
 
 using namespace std;
 
+// Where the lexer, parser, compiler and VM report problems with a program.
+// Per thread, so interpreters on different threads can each send theirs
+// somewhere else (Interpreter::setErrors, compileProgram).
+thread_local ostream* diagnostics = &cerr;
+
 // Token types
 enum TokenType {
     TOK_EOF, TOK_LET, TOK_PRINT, TOK_WRITE, TOK_CLEAR, TOK_INPUT, TOK_INPUT_NUM, TOK_WHEN, TOK_OTHERWISE,
     TOK_REPEAT, TOK_TIMES, TOK_LOOP, TOK_WHILE, TOK_FROM, TOK_TO,
     TOK_LABEL, TOK_GOTO, TOK_RANDOM, TOK_SQRT, TOK_POW, TOK_ABS, TOK_FLOOR, TOK_CEIL,
-    TOK_CALL, TOK_DEFINE,
+    TOK_CALL, TOK_DEFINE, TOK_RETURN,
     TOK_ARROW_RIGHT, TOK_ARROW_LEFT, TOK_IDENT, TOK_NUMBER, TOK_STRING,
-    TOK_PLUS, TOK_MINUS, TOK_STAR, TOK_SLASH, TOK_PERCENT, TOK_LPAREN, TOK_RPAREN,
+    TOK_PLUS, TOK_MINUS, TOK_STAR, TOK_SLASH, TOK_PERCENT, TOK_LPAREN, TOK_RPAREN, TOK_LBRACKET, TOK_RBRACKET,
+    TOK_LBRACE, TOK_RBRACE, TOK_COLON,
     TOK_EQ, TOK_EQEQ, TOK_NEQ, TOK_LT, TOK_GT, TOK_LTE, TOK_GTE,
     TOK_COMMA, TOK_NEWLINE
 };
 
+// value points into the source text (or is a literal), so tokens are only
+// valid while the source is
 struct Token {
     TokenType type;
-    string value;
+    string_view value;
     int line;
 };
 
+// Keywords, found with a perfect hash: every keyword has a slot of its own
+// (checked when flow is compiled), so telling an identifier from a keyword
+// costs one hash and one compare
+struct Keyword {
+    string_view name;
+    TokenType type = TOK_IDENT;
+};
+
+constexpr Keyword KEYWORDS[] = {
+    {"let", TOK_LET}, {"print", TOK_PRINT}, {"write", TOK_WRITE}, {"clear", TOK_CLEAR},
+    {"input", TOK_INPUT}, {"input_num", TOK_INPUT_NUM}, {"when", TOK_WHEN}, {"otherwise", TOK_OTHERWISE},
+    {"repeat", TOK_REPEAT}, {"times", TOK_TIMES}, {"loop", TOK_LOOP}, {"while", TOK_WHILE},
+    {"from", TOK_FROM}, {"to", TOK_TO}, {"label", TOK_LABEL}, {"goto", TOK_GOTO},
+    {"random", TOK_RANDOM}, {"sqrt", TOK_SQRT}, {"pow", TOK_POW}, {"abs", TOK_ABS},
+    {"floor", TOK_FLOOR}, {"ceil", TOK_CEIL}, {"call", TOK_CALL}, {"define", TOK_DEFINE},
+    {"return", TOK_RETURN},
+};
+
+constexpr size_t KEYWORD_SLOTS = 64;
+
+// Length, first two and last characters; word is never empty
+constexpr size_t keywordHash(string_view word) {
+    unsigned char second = word.size() > 1 ? word[1] : 0;
+    return (word.size() * 7 + (unsigned char)word[0] * 19 + second + (unsigned char)word.back()) &
+           (KEYWORD_SLOTS - 1);
+}
+
+struct KeywordTable {
+    Keyword slots[KEYWORD_SLOTS] = {};
+    bool perfect = true;
+
+    constexpr KeywordTable() {
+        for (const Keyword& keyword : KEYWORDS) {
+            Keyword& slot = slots[keywordHash(keyword.name)];
+            if (!slot.name.empty()) perfect = false;
+            slot = keyword;
+        }
+    }
+
+    TokenType find(string_view word) const {
+        const Keyword& slot = slots[keywordHash(word)];
+        return slot.name == word ? slot.type : TOK_IDENT;
+    }
+};
+
+constexpr KeywordTable keywordTable;
+static_assert(keywordTable.perfect, "two keywords hash to the same slot; change keywordHash");
+
 // Lexer
 class Lexer {
-    string source;
+    string_view source;
     size_t pos;
     int line;
 
 public:
-    Lexer(const string& src) : source(src), pos(0), line(1) {}
+    // source must outlive the tokens, which point into it; firstLine numbers
+    // the first line of source (the REPL's entries go on from the last one)
+    Lexer(string_view src, int firstLine = 1) : source(src), pos(0), line(firstLine) {}
 
     vector<Token> tokenize() {
         vector<Token> tokens;
+        // Scripts run 4 to 7 bytes a token, so this is usually the only allocation
+        tokens.reserve(source.size() / 4 + 16);
         while (pos < source.length()) {
             char c = source[pos];
 
@@ -91,6 +169,11 @@ public:
             if (c == '(') { tokens.push_back({TOK_LPAREN, "(", line}); pos++; continue; }
             if (c == ')') { tokens.push_back({TOK_RPAREN, ")", line}); pos++; continue; }
             if (c == ',') { tokens.push_back({TOK_COMMA, ",", line}); pos++; continue; }
+            if (c == '[') { tokens.push_back({TOK_LBRACKET, "[", line}); pos++; continue; }
+            if (c == ']') { tokens.push_back({TOK_RBRACKET, "]", line}); pos++; continue; }
+            if (c == '{') { tokens.push_back({TOK_LBRACE, "{", line}); pos++; continue; }
+            if (c == '}') { tokens.push_back({TOK_RBRACE, "}", line}); pos++; continue; }
+            if (c == ':') { tokens.push_back({TOK_COLON, ":", line}); pos++; continue; }
 
             // Multi-character operators
             if (c == '-') {
@@ -148,7 +231,7 @@ public:
                 }
             }
 
-            cerr << "Unknown character: " << c << " at line " << line << endl;
+            *diagnostics << "Unknown character: " << c << " at line " << line << endl;
             pos++;
         }
 
@@ -158,99 +241,221 @@ public:
 
 private:
     Token readString() {
-        pos++; // skip opening quote
-        string value;
-        while (pos < source.length() && source[pos] != '"') {
-            value += source[pos++];
-        }
+        size_t start = ++pos; // skip opening quote
+        while (pos < source.length() && source[pos] != '"') pos++;
+        string_view value = source.substr(start, pos - start);
         pos++; // skip closing quote
         return {TOK_STRING, value, line};
     }
 
     Token readNumber() {
-        string value;
-        while (pos < source.length() && (isdigit(source[pos]) || source[pos] == '.')) {
-            value += source[pos++];
-        }
-        return {TOK_NUMBER, value, line};
+        size_t start = pos;
+        while (pos < source.length() && (isdigit(source[pos]) || source[pos] == '.')) pos++;
+        return {TOK_NUMBER, source.substr(start, pos - start), line};
     }
 
     Token readIdentifier() {
-        string value;
-        while (pos < source.length() && (isalnum(source[pos]) || source[pos] == '_')) {
-            value += source[pos++];
-        }
-
-        // Check for keywords
-        if (value == "let") return {TOK_LET, value, line};
-        if (value == "print") return {TOK_PRINT, value, line};
-        if (value == "write") return {TOK_WRITE, value, line};
-        if (value == "clear") return {TOK_CLEAR, value, line};
-        if (value == "input") return {TOK_INPUT, value, line};
-        if (value == "input_num") return {TOK_INPUT_NUM, value, line};
-        if (value == "when") return {TOK_WHEN, value, line};
-        if (value == "otherwise") return {TOK_OTHERWISE, value, line};
-        if (value == "repeat") return {TOK_REPEAT, value, line};
-        if (value == "times") return {TOK_TIMES, value, line};
-        if (value == "loop") return {TOK_LOOP, value, line};
-        if (value == "while") return {TOK_WHILE, value, line};
-        if (value == "from") return {TOK_FROM, value, line};
-        if (value == "to") return {TOK_TO, value, line};
-        if (value == "label") return {TOK_LABEL, value, line};
-        if (value == "goto") return {TOK_GOTO, value, line};
-        if (value == "random") return {TOK_RANDOM, value, line};
-        if (value == "sqrt") return {TOK_SQRT, value, line};
-        if (value == "pow") return {TOK_POW, value, line};
-        if (value == "abs") return {TOK_ABS, value, line};
-        if (value == "floor") return {TOK_FLOOR, value, line};
-        if (value == "ceil") return {TOK_CEIL, value, line};
-        if (value == "call") return {TOK_CALL, value, line};
-        if (value == "define") return {TOK_DEFINE, value, line};
-
-        return {TOK_IDENT, value, line};
+        size_t start = pos;
+        while (pos < source.length() && (isalnum(source[pos]) || source[pos] == '_')) pos++;
+        string_view value = source.substr(start, pos - start);
+        return {keywordTable.find(value), value, line};
     }
 };
 // AST Node types
-enum NodeType {
+enum NodeType : unsigned char {
     NODE_PROGRAM, NODE_LET, NODE_PRINT, NODE_WRITE, NODE_CLEAR, NODE_INPUT, NODE_INPUT_NUM, NODE_WHEN, NODE_REPEAT,
     NODE_LOOP_WHILE, NODE_LOOP_FOR, NODE_LABEL, NODE_GOTO, NODE_BLOCK,
-    NODE_BINOP, NODE_UNARY, NODE_NUMBER, NODE_STRING, NODE_IDENT, NODE_CALL
+    NODE_BINOP, NODE_UNARY, NODE_NUMBER, NODE_STRING, NODE_IDENT, NODE_CALL,
+    NODE_DEFINE, NODE_RETURN, NODE_PROC_CALL,
+    NODE_ARRAY, NODE_INDEX, NODE_LET_INDEX, NODE_PUSH, NODE_FILL,
+    NODE_DICT, NODE_REMOVE, NODE_LOOP_EACH
+};
+
+// Operators and builtins are decoded once by the parser
+enum Operator : unsigned char {
+    OPR_NONE, OPR_ADD, OPR_SUB, OPR_MUL, OPR_DIV, OPR_MOD,
+    OPR_EQ, OPR_NEQ, OPR_LT, OPR_GT, OPR_LTE, OPR_GTE, OPR_NEG
+};
+
+enum Builtin : unsigned char {
+    FN_NONE, FN_RANDOM, FN_SQRT, FN_POW, FN_ABS, FN_FLOOR, FN_CEIL, FN_ARRAY, FN_LEN,
+    FN_SUM, FN_MIN, FN_MAX, FN_DOT, FN_SCALE, FN_CLAMP, FN_HAS, FN_KEYS, FN_RANDOMS
+};
+
+// Array and dictionary builtins. These names are common variable names, so
+// they are only builtins when followed by '(' rather than being keywords.
+Builtin builtinNamed(string_view name) {
+    static const map<string, Builtin, less<>> builtins = {
+        {"sum", FN_SUM}, {"min", FN_MIN}, {"max", FN_MAX}, {"dot", FN_DOT}, {"scale", FN_SCALE}, {"clamp", FN_CLAMP},
+        {"has", FN_HAS}, {"keys", FN_KEYS}, {"randoms", FN_RANDOMS}, {"array", FN_ARRAY}, {"len", FN_LEN},
+    };
+    auto it = builtins.find(name);
+    return it == builtins.end() ? FN_NONE : it->second;
+}
+
+// Arguments a builtin call is compiled with; min and max take an array or
+// two numbers, randoms takes a count and optionally a range
+size_t builtinArity(Builtin fn, size_t given) {
+    switch (fn) {
+    case FN_RANDOM: case FN_POW: case FN_DOT: case FN_SCALE: case FN_HAS: return 2;
+    case FN_CLAMP: return 3;
+    case FN_MIN: case FN_MAX: return given == 2 ? 2 : 1;
+    case FN_RANDOMS: return given >= 2 ? 3 : 1;
+    default: return 1;
+    }
+}
+
+const char* operatorSymbol(Operator op) {
+    static const char* symbols[] = {"", "+", "-", "*", "/", "%", "==", "!=", "<", ">", "<=", ">=", "-"};
+    return symbols[op];
+}
+
+Operator operatorFor(TokenType type) {
+    switch (type) {
+    case TOK_PLUS: return OPR_ADD;
+    case TOK_MINUS: return OPR_SUB;
+    case TOK_STAR: return OPR_MUL;
+    case TOK_SLASH: return OPR_DIV;
+    case TOK_PERCENT: return OPR_MOD;
+    case TOK_EQEQ: return OPR_EQ;
+    case TOK_NEQ: return OPR_NEQ;
+    case TOK_LT: return OPR_LT;
+    case TOK_GT: return OPR_GT;
+    case TOK_LTE: return OPR_LTE;
+    case TOK_GTE: return OPR_GTE;
+    default: return OPR_NONE;
+    }
+}
+
+struct ASTNode;
+
+// Owns a parsed program. Nodes, their child lists and any text not taken
+// straight from the source (folded strings) are carved out of large blocks,
+// so parsing allocates a block now and then instead of once per node, and
+// the whole tree is freed with the arena; nothing in it has a destructor to
+// run.
+class AstArena {
+    static constexpr size_t BLOCK = 64 * 1024;
+    vector<unique_ptr<char[]>> blocks;
+    char* next = nullptr;
+    size_t left = 0;
+
+public:
+    AstArena() = default;
+    AstArena(const AstArena&) = delete;
+    AstArena& operator=(const AstArena&) = delete;
+
+    void* allocate(size_t bytes, size_t align) {
+        size_t pad = -(uintptr_t)next & (align - 1);
+        if (pad + bytes > left) {
+            size_t size = max(BLOCK, bytes + align);
+            blocks.emplace_back(new char[size]);
+            next = blocks.back().get();
+            left = size;
+            pad = -(uintptr_t)next & (align - 1);
+        }
+        char* at = next + pad;
+        next = at + bytes;
+        left -= pad + bytes;
+        return at;
+    }
+
+    template <typename T>
+    T* make() { return new (allocate(sizeof(T), alignof(T))) T(); }
+
+    // A copy of s that lasts as long as the arena
+    string_view text(string_view s) {
+        if (s.empty()) return {};
+        char* at = (char*)allocate(s.size(), 1);
+        memcpy(at, s.data(), s.size());
+        return {at, s.size()};
+    }
+};
+
+// A node's children, in arena storage; when full they move to a new array
+// twice the size (the old one is simply left in the arena)
+class NodeList {
+    ASTNode** items = nullptr;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+
+public:
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    ASTNode*& operator[](size_t i) { return items[i]; }
+    ASTNode* operator[](size_t i) const { return items[i]; }
+    ASTNode*& back() { return items[count - 1]; }
+    ASTNode* back() const { return items[count - 1]; }
+    ASTNode** begin() { return items; }
+    ASTNode** end() { return items + count; }
+    ASTNode* const* begin() const { return items; }
+    ASTNode* const* end() const { return items + count; }
+    void pop_back() { count--; }
+
+    void push_back(AstArena& arena, ASTNode* node) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 2;
+            auto grown = (ASTNode**)arena.allocate(capacity * sizeof(ASTNode*), alignof(ASTNode*));
+            if (count) memcpy(grown, items, count * sizeof(ASTNode*));
+            items = grown;
+        }
+        items[count++] = node;
+    }
 };
 
 struct ASTNode {
     NodeType type;
-    string value;
-    vector<shared_ptr<ASTNode>> children;
+    Operator op = OPR_NONE;  // NODE_BINOP and NODE_UNARY
+    Builtin fn = FN_NONE;    // NODE_CALL
+    bool local = false;      // slot is a procedure local rather than a global
+    int slot = -1;           // variable slot for NODE_LET, NODE_IDENT, NODE_LOOP_FOR and the array nodes
+    int line = 0;            // source line the node starts on
+    double number = 0;       // parsed literal for NODE_NUMBER
+    string_view value;       // name or literal text, in the source or the arena
+    NodeList children;
 };
 
+static_assert(is_trivially_destructible<ASTNode>::value, "AST nodes are freed with their arena");
+
 // Parser
 class Parser {
-    vector<Token> tokens;
+    const vector<Token>& tokens;
+    AstArena& arena;
     size_t pos;
+    int depth;  // blocks currently open
 
 public:
-    Parser(const vector<Token>& toks) : tokens(toks), pos(0) {}
+    Parser(const vector<Token>& toks, AstArena& arena) : tokens(toks), arena(arena), pos(0), depth(0) {}
 
-    shared_ptr<ASTNode> parse() {
-        auto program = make_shared<ASTNode>();
+    ASTNode* parse() {
+        auto program = newNode();
         program->type = NODE_PROGRAM;
 
         while (current().type != TOK_EOF) {
             skipNewlines();
             if (current().type == TOK_EOF) break;
-            program->children.push_back(parseStatement());
+            add(program, parseStatement());
         }
 
         return program;
     }
 
 private:
-    Token current() { return tokens[pos]; }
-    Token peek(int offset = 1) { return tokens[min(pos + offset, tokens.size() - 1)]; }
-    void advance() { pos++; }
+    const Token& current() { return tokens[pos]; }
+    const Token& peek(int offset = 1) { return tokens[min(pos + offset, tokens.size() - 1)]; }
+    void advance() { if (pos + 1 < tokens.size()) pos++; }  // never past TOK_EOF
     void skipNewlines() { while (current().type == TOK_NEWLINE) advance(); }
 
-    shared_ptr<ASTNode> parseStatement() {
+    // A node tagged with the line of the current token
+    ASTNode* newNode() {
+        auto node = arena.make<ASTNode>();
+        node->line = current().line;
+        return node;
+    }
+
+    void add(ASTNode* parent, ASTNode* child) { parent->children.push_back(arena, child); }
+
+    ASTNode* parseStatement() {
         skipNewlines();
 
         if (current().type == TOK_LET) return parseLet();
@@ -262,75 +467,94 @@ private:
         if (current().type == TOK_LOOP) return parseLoop();
         if (current().type == TOK_LABEL) return parseLabel();
         if (current().type == TOK_GOTO) return parseGoto();
+        if (current().type == TOK_DEFINE) return parseDefine();
+        if (current().type == TOK_CALL) {
+            auto node = parseCall();
+            skipNewlines();
+            return node;
+        }
+        if (current().type == TOK_RETURN) return parseReturn();
+        // push, fill and remove are statements only when a variable follows,
+        // so they stay usable as variable names
+        if (current().type == TOK_IDENT && peek().type == TOK_IDENT &&
+            (current().value == "push" || current().value == "fill" || current().value == "remove")) {
+            return parseUpdate();
+        }
 
-        cerr << "Unexpected token: " << current().value << " at line " << current().line << endl;
+        *diagnostics << "Unexpected token: " << current().value << " at line " << current().line << endl;
         advance();
         return nullptr;
     }
 
-    shared_ptr<ASTNode> parseLet() {
-        auto node = make_shared<ASTNode>();
+    ASTNode* parseLet() {
+        auto node = newNode();
         node->type = NODE_LET;
         advance(); // skip 'let'
 
         node->value = current().value; // variable name
         advance();
 
+        // let name[index] = value: children are the index, then the value
+        if (current().type == TOK_LBRACKET) {
+            node->type = NODE_LET_INDEX;
+            add(node, parseIndex());
+        }
+
         if (current().type != TOK_EQ) {
-            cerr << "Expected '=' after variable name" << endl;
-            return node;
+            *diagnostics << "Expected '=' after variable name" << endl;
+            return nullptr;
         }
         advance();
 
-        node->children.push_back(parseExpression());
+        add(node, parseExpression());
         skipNewlines();
         return node;
     }
 
-    shared_ptr<ASTNode> parsePrint() {
-        auto node = make_shared<ASTNode>();
+    ASTNode* parsePrint() {
+        auto node = newNode();
         node->type = NODE_PRINT;
         advance(); // skip 'print'
 
-        node->children.push_back(parseExpression());
+        add(node, parseExpression());
         skipNewlines();
         return node;
     }
 
-    shared_ptr<ASTNode> parseWrite() {
-        auto node = make_shared<ASTNode>();
+    ASTNode* parseWrite() {
+        auto node = newNode();
         node->type = NODE_WRITE;
         advance(); // skip 'write'
 
-        node->children.push_back(parseExpression());
+        add(node, parseExpression());
         skipNewlines();
         return node;
     }
 
-    shared_ptr<ASTNode> parseClear() {
-        auto node = make_shared<ASTNode>();
+    ASTNode* parseClear() {
+        auto node = newNode();
         node->type = NODE_CLEAR;
         advance(); // skip 'clear'
         skipNewlines();
         return node;
     }
 
-    shared_ptr<ASTNode> parseWhen() {
-        auto node = make_shared<ASTNode>();
+    ASTNode* parseWhen() {
+        auto node = newNode();
         node->type = NODE_WHEN;
         advance(); // skip 'when'
 
-        node->children.push_back(parseExpression()); // condition
+        add(node, parseExpression()); // condition
         skipNewlines();
 
         if (current().type != TOK_ARROW_RIGHT) {
-            cerr << "Expected '->' after condition" << endl;
-            return node;
+            *diagnostics << "Expected '->' after condition" << endl;
+            return nullptr;
         }
         advance();
         skipNewlines();
 
-        node->children.push_back(parseBlock()); // then block
+        add(node, parseBlock()); // then block
 
         skipNewlines();
         if (current().type == TOK_OTHERWISE) {
@@ -339,58 +563,58 @@ private:
             if (current().type == TOK_ARROW_RIGHT) {
                 advance();
                 skipNewlines();
-                node->children.push_back(parseBlock()); // else block
+                add(node, parseBlock()); // else block
             }
         }
 
         return node;
     }
 
-    shared_ptr<ASTNode> parseRepeat() {
-        auto node = make_shared<ASTNode>();
+    ASTNode* parseRepeat() {
+        auto node = newNode();
         node->type = NODE_REPEAT;
         advance(); // skip 'repeat'
 
-        node->children.push_back(parseExpression()); // count
+        add(node, parseExpression()); // count
 
         if (current().type == TOK_TIMES) advance();
         skipNewlines();
 
         if (current().type != TOK_ARROW_RIGHT) {
-            cerr << "Expected '->' after repeat count" << endl;
-            return node;
+            *diagnostics << "Expected '->' after repeat count" << endl;
+            return nullptr;
         }
         advance();
         skipNewlines();
 
-        node->children.push_back(parseBlock());
+        add(node, parseBlock());
         return node;
     }
 
-    shared_ptr<ASTNode> parseLoop() {
+    ASTNode* parseLoop() {
         advance(); // skip 'loop'
 
         if (current().type == TOK_WHILE) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_LOOP_WHILE;
             advance();
 
-            node->children.push_back(parseExpression()); // condition
+            add(node, parseExpression()); // condition
             skipNewlines();
 
             if (current().type != TOK_ARROW_RIGHT) {
-                cerr << "Expected '->' after while condition" << endl;
-                return node;
+                *diagnostics << "Expected '->' after while condition" << endl;
+                return nullptr;
             }
             advance();
             skipNewlines();
 
-            node->children.push_back(parseBlock());
+            add(node, parseBlock());
             return node;
         }
 
         if (current().type == TOK_FROM) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_LOOP_FOR;
             advance();
 
@@ -398,39 +622,76 @@ private:
             advance();
 
             if (current().type != TOK_EQ) {
-                cerr << "Expected '=' in for loop" << endl;
-                return node;
+                *diagnostics << "Expected '=' in for loop" << endl;
+                return nullptr;
             }
             advance();
 
-            node->children.push_back(parseExpression()); // start value
+            add(node, parseExpression()); // start value
 
             if (current().type != TOK_TO) {
-                cerr << "Expected 'to' in for loop" << endl;
-                return node;
+                *diagnostics << "Expected 'to' in for loop" << endl;
+                return nullptr;
             }
             advance();
 
-            node->children.push_back(parseExpression()); // end value
+            add(node, parseExpression()); // end value
+
+            // Optional "step n"; like "each", step is only special here
+            ASTNode* step = nullptr;
+            if (current().type == TOK_IDENT && current().value == "step") {
+                advance();
+                step = parseExpression();
+            }
             skipNewlines();
 
             if (current().type != TOK_ARROW_RIGHT) {
-                cerr << "Expected '->' after for loop range" << endl;
-                return node;
+                *diagnostics << "Expected '->' after for loop range" << endl;
+                return nullptr;
+            }
+            advance();
+            skipNewlines();
+
+            add(node, parseBlock());
+            if (step) add(node, step); // after the body, which stays children[2]
+            return node;
+        }
+
+        // loop each name in collection: "each" and "in" are only special here
+        if (current().type == TOK_IDENT && current().value == "each") {
+            auto node = newNode();
+            node->type = NODE_LOOP_EACH;
+            advance();
+
+            node->value = current().value; // loop variable
+            advance();
+
+            if (current().type != TOK_IDENT || current().value != "in") {
+                *diagnostics << "Expected 'in' in loop each" << endl;
+                return nullptr;
+            }
+            advance();
+
+            add(node, parseExpression()); // array or dictionary
+            skipNewlines();
+
+            if (current().type != TOK_ARROW_RIGHT) {
+                *diagnostics << "Expected '->' after loop each" << endl;
+                return nullptr;
             }
             advance();
             skipNewlines();
 
-            node->children.push_back(parseBlock());
+            add(node, parseBlock());
             return node;
         }
 
-        cerr << "Expected 'while' or 'from' after 'loop'" << endl;
+        *diagnostics << "Expected 'while', 'from' or 'each' after 'loop'" << endl;
         return nullptr;
     }
 
-    shared_ptr<ASTNode> parseLabel() {
-        auto node = make_shared<ASTNode>();
+    ASTNode* parseLabel() {
+        auto node = newNode();
         node->type = NODE_LABEL;
         advance(); // skip 'label'
 
@@ -440,8 +701,8 @@ private:
         return node;
     }
 
-    shared_ptr<ASTNode> parseGoto() {
-        auto node = make_shared<ASTNode>();
+    ASTNode* parseGoto() {
+        auto node = newNode();
         node->type = NODE_GOTO;
         advance(); // skip 'goto'
 
@@ -451,15 +712,123 @@ private:
         return node;
     }
 
-    shared_ptr<ASTNode> parseBlock() {
-        auto block = make_shared<ASTNode>();
+    // push name, value / fill name, value / remove name, key
+    ASTNode* parseUpdate() {
+        auto node = newNode();
+        node->type = current().value == "push" ? NODE_PUSH : current().value == "fill" ? NODE_FILL : NODE_REMOVE;
+        string_view keyword = current().value;
+        advance();
+
+        node->value = current().value; // array variable
+        advance();
+
+        if (current().type != TOK_COMMA) {
+            *diagnostics << "Expected ',' after " << keyword << " " << node->value << endl;
+            return nullptr;
+        }
+        advance();
+
+        add(node, parseExpression());
+        skipNewlines();
+        return node;
+    }
+
+    // [expression]
+    ASTNode* parseIndex() {
+        advance(); // skip '['
+        auto index = parseExpression();
+        if (current().type == TOK_RBRACKET) advance();
+        else *diagnostics << "Expected ']' after index" << endl;
+        return index;
+    }
+
+    // define name(param, ...) -> body <-
+    // Children are the parameters as NODE_IDENTs followed by the body block
+    ASTNode* parseDefine() {
+        auto node = newNode();
+        node->type = NODE_DEFINE;
+        int line = current().line;
+        advance(); // skip 'define'
+
+        node->value = current().value; // procedure name
+        advance();
+
+        if (current().type == TOK_LPAREN) {
+            advance();
+            while (current().type == TOK_IDENT) {
+                auto param = newNode();
+                param->type = NODE_IDENT;
+                param->value = current().value;
+                add(node, param);
+                advance();
+                if (current().type == TOK_COMMA) advance();
+            }
+            if (current().type != TOK_RPAREN) {
+                *diagnostics << "Expected ')' after parameters of " << node->value << endl;
+                return nullptr;
+            }
+            advance();
+        }
+        skipNewlines();
+
+        if (current().type != TOK_ARROW_RIGHT) {
+            *diagnostics << "Expected '->' after define " << node->value << endl;
+            return nullptr;
+        }
+        advance();
+        skipNewlines();
+
+        add(node, parseBlock());
+        if (depth > 0) {
+            *diagnostics << "define is only allowed at the top level of a program, at line " << line << endl;
+            return nullptr;
+        }
+        return node;
+    }
+
+    // call name(arg, ...), as a statement or inside an expression
+    ASTNode* parseCall() {
+        auto node = newNode();
+        node->type = NODE_PROC_CALL;
+        advance(); // skip 'call'
+
+        node->value = current().value;
+        advance();
+
+        if (current().type == TOK_LPAREN) {
+            advance();
+            while (current().type != TOK_RPAREN && current().type != TOK_NEWLINE && current().type != TOK_EOF) {
+                add(node, parseExpression());
+                if (current().type == TOK_COMMA) advance();
+                else break;
+            }
+            if (current().type == TOK_RPAREN) advance();
+        }
+        return node;
+    }
+
+    ASTNode* parseReturn() {
+        auto node = newNode();
+        node->type = NODE_RETURN;
+        advance(); // skip 'return'
+
+        if (current().type != TOK_NEWLINE && current().type != TOK_ARROW_LEFT && current().type != TOK_EOF) {
+            add(node, parseExpression());
+        }
+        skipNewlines();
+        return node;
+    }
+
+    ASTNode* parseBlock() {
+        auto block = newNode();
         block->type = NODE_BLOCK;
+        depth++;
 
         while (current().type != TOK_ARROW_LEFT && current().type != TOK_EOF) {
             skipNewlines();
             if (current().type == TOK_ARROW_LEFT) break;
             auto stmt = parseStatement();
-            if (stmt) block->children.push_back(stmt);
+            if (stmt) add(block, stmt);
         }
 
         if (current().type == TOK_ARROW_LEFT) {
@@ -467,86 +836,96 @@ private:
             skipNewlines();
         }
 
+        depth--;
         return block;
     }
 
-    shared_ptr<ASTNode> parseExpression() {
+    ASTNode* parseExpression() {
         return parseComparison();
     }
 
-    shared_ptr<ASTNode> parseComparison() {
+    ASTNode* parseComparison() {
         auto left = parseTerm();
 
         while (current().type == TOK_EQEQ || current().type == TOK_NEQ ||
                current().type == TOK_LT || current().type == TOK_GT ||
                current().type == TOK_LTE || current().type == TOK_GTE) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_BINOP;
             node->value = current().value;
+            node->op = operatorFor(current().type);
             advance();
 
-            node->children.push_back(left);
-            node->children.push_back(parseTerm());
+            add(node, left);
+            add(node, parseTerm());
             left = node;
         }
 
         return left;
     }
 
-    shared_ptr<ASTNode> parseTerm() {
+    ASTNode* parseTerm() {
         auto left = parseFactor();
 
         while (current().type == TOK_PLUS || current().type == TOK_MINUS) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_BINOP;
             node->value = current().value;
+            node->op = operatorFor(current().type);
             advance();
 
-            node->children.push_back(left);
-            node->children.push_back(parseFactor());
+            add(node, left);
+            add(node, parseFactor());
             left = node;
         }
 
         return left;
     }
 
-    shared_ptr<ASTNode> parseFactor() {
+    ASTNode* parseFactor() {
         auto left = parsePrimary();
 
         while (current().type == TOK_STAR || current().type == TOK_SLASH || current().type == TOK_PERCENT) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_BINOP;
             node->value = current().value;
+            node->op = operatorFor(current().type);
             advance();
 
-            node->children.push_back(left);
-            node->children.push_back(parsePrimary());
+            add(node, left);
+            add(node, parsePrimary());
             left = node;
         }
 
         return left;
     }
-shared_ptr<ASTNode> parsePrimary() {
+ASTNode* parsePrimary() {
         // Handle unary minus
         if (current().type == TOK_MINUS) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_UNARY;
             node->value = "-";
+            node->op = OPR_NEG;
             advance();
-            node->children.push_back(parsePrimary());
+            add(node, parsePrimary());
             return node;
         }
 
         if (current().type == TOK_NUMBER) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_NUMBER;
             node->value = current().value;
+            // Digits and dots only; anything after a second dot is ignored
+            string_view digits = current().value;
+            if (from_chars(digits.data(), digits.data() + digits.size(), node->number).ec == errc::result_out_of_range) {
+                node->number = HUGE_VAL;
+            }
             advance();
             return node;
         }
 
         if (current().type == TOK_STRING) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_STRING;
             node->value = current().value;
             advance();
@@ -554,22 +933,79 @@ shared_ptr<ASTNode> parsePrimary() {
         }
 
         if (current().type == TOK_IDENT) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_IDENT;
             node->value = current().value;
             advance();
+
+            if (current().type == TOK_LBRACKET) {
+                node->type = NODE_INDEX;
+                add(node, parseIndex());
+            } else if (current().type == TOK_LPAREN && builtinNamed(node->value) != FN_NONE) {
+                node->type = NODE_CALL;
+                node->fn = builtinNamed(node->value);
+                advance();
+                while (current().type != TOK_RPAREN && current().type != TOK_NEWLINE && current().type != TOK_EOF) {
+                    add(node, parseExpression());
+                    if (current().type == TOK_COMMA) advance();
+                    else break;
+                }
+                if (current().type == TOK_RPAREN) advance();
+            }
+            return node;
+        }
+
+        // Dictionary literal: {key: value, ...}; children alternate key, value
+        if (current().type == TOK_LBRACE) {
+            auto node = newNode();
+            node->type = NODE_DICT;
+            advance();
+            skipNewlines();
+
+            while (current().type != TOK_RBRACE && current().type != TOK_EOF) {
+                add(node, parseExpression());
+                if (current().type != TOK_COLON) {
+                    *diagnostics << "Expected ':' after dictionary key" << endl;
+                    node->children.pop_back();
+                    break;
+                }
+                advance();
+                add(node, parseExpression());
+                skipNewlines();
+                if (current().type == TOK_COMMA) advance();
+                else break;
+                skipNewlines();
+            }
+            if (current().type == TOK_RBRACE) advance();
+            else *diagnostics << "Expected '}' after dictionary entries" << endl;
+            return node;
+        }
+
+        // Array literal: [a, b, c]
+        if (current().type == TOK_LBRACKET) {
+            auto node = newNode();
+            node->type = NODE_ARRAY;
+            advance();
+
+            while (current().type != TOK_RBRACKET && current().type != TOK_NEWLINE && current().type != TOK_EOF) {
+                add(node, parseExpression());
+                if (current().type == TOK_COMMA) advance();
+                else break;
+            }
+            if (current().type == TOK_RBRACKET) advance();
+            else *diagnostics << "Expected ']' after array elements" << endl;
             return node;
         }
 
         if (current().type == TOK_INPUT) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_INPUT;
             advance();
 
             if (current().type == TOK_LPAREN) {
                 advance();
                 if (current().type == TOK_STRING) {
-                    node->children.push_back(parseExpression()); // prompt
+                    add(node, parseExpression()); // prompt
                 }
                 if (current().type == TOK_RPAREN) advance();
             }
@@ -577,14 +1013,14 @@ shared_ptr<ASTNode> parsePrimary() {
         }
 
         if (current().type == TOK_INPUT_NUM) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_INPUT_NUM;
             advance();
 
             if (current().type == TOK_LPAREN) {
                 advance();
                 if (current().type == TOK_STRING) {
-                    node->children.push_back(parseExpression()); // prompt
+                    add(node, parseExpression()); // prompt
                 }
                 if (current().type == TOK_RPAREN) advance();
             }
@@ -592,93 +1028,101 @@ shared_ptr<ASTNode> parsePrimary() {
         }
 
         if (current().type == TOK_RANDOM) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_CALL;
             node->value = "random";
+            node->fn = FN_RANDOM;
             advance();
 
             if (current().type == TOK_LPAREN) {
                 advance();
-                node->children.push_back(parseExpression()); // min
+                add(node, parseExpression()); // min
                 if (current().type == TOK_COMMA) advance();
-                node->children.push_back(parseExpression()); // max
+                add(node, parseExpression()); // max
                 if (current().type == TOK_RPAREN) advance();
             }
             return node;
         }
 
         if (current().type == TOK_SQRT) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_CALL;
             node->value = "sqrt";
+            node->fn = FN_SQRT;
             advance();
 
             if (current().type == TOK_LPAREN) {
                 advance();
-                node->children.push_back(parseExpression());
+                add(node, parseExpression());
                 if (current().type == TOK_RPAREN) advance();
             }
             return node;
         }
 
         if (current().type == TOK_POW) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_CALL;
             node->value = "pow";
+            node->fn = FN_POW;
             advance();
 
             if (current().type == TOK_LPAREN) {
                 advance();
-                node->children.push_back(parseExpression()); // base
+                add(node, parseExpression()); // base
                 if (current().type == TOK_COMMA) advance();
-                node->children.push_back(parseExpression()); // exponent
+                add(node, parseExpression()); // exponent
                 if (current().type == TOK_RPAREN) advance();
             }
             return node;
         }
 
         if (current().type == TOK_ABS) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_CALL;
             node->value = "abs";
+            node->fn = FN_ABS;
             advance();
 
             if (current().type == TOK_LPAREN) {
                 advance();
-                node->children.push_back(parseExpression());
+                add(node, parseExpression());
                 if (current().type == TOK_RPAREN) advance();
             }
             return node;
         }
 
         if (current().type == TOK_FLOOR) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_CALL;
             node->value = "floor";
+            node->fn = FN_FLOOR;
             advance();
 
             if (current().type == TOK_LPAREN) {
                 advance();
-                node->children.push_back(parseExpression());
+                add(node, parseExpression());
                 if (current().type == TOK_RPAREN) advance();
             }
             return node;
         }
 
         if (current().type == TOK_CEIL) {
-            auto node = make_shared<ASTNode>();
+            auto node = newNode();
             node->type = NODE_CALL;
             node->value = "ceil";
+            node->fn = FN_CEIL;
             advance();
 
             if (current().type == TOK_LPAREN) {
                 advance();
-                node->children.push_back(parseExpression());
+                add(node, parseExpression());
                 if (current().type == TOK_RPAREN) advance();
             }
             return node;
         }
 
+        if (current().type == TOK_CALL) return parseCall();
+
         if (current().type == TOK_LPAREN) {
             advance();
             auto expr = parseExpression();
@@ -686,314 +1130,4183 @@ shared_ptr<ASTNode> parsePrimary() {
             return expr;
         }
 
-        cerr << "Unexpected token in expression: " << current().value << endl;
+        *diagnostics << "Unexpected token in expression: " << current().value << endl;
         advance();
-        return make_shared<ASTNode>();
+        return newNode();
     }
 };
 
-// Value type for variables
-struct Value {
-    bool is_string;
-    double num_value;
-    string str_value;
-    
-    Value() : is_string(false), num_value(0) {}
-    Value(double n) : is_string(false), num_value(n) {}
-    Value(string s) : is_string(true), str_value(s), num_value(0) {}
-};
-// Interpreter
-class Interpreter {
-    map<string, Value> variables;
-    map<string, size_t> labels;
-    shared_ptr<ASTNode> program;
-    bool gotoFlag;
-    string gotoTarget;
+// Resolver: gives every distinct variable name a numbered slot so the
+// runtime can keep variables in a flat vector instead of a map.
+//
+// Every name the main program uses is a global. Inside a procedure the
+// parameters, and any other variable it assigns that the main program never
+// mentions, are locals: each call gets fresh copies in its own frame.
+class Resolver {
+    map<string, int, less<>> slots;
+    vector<string>& names;  // slot -> name; the compiler adds unnamed slots of its own
+    map<string, int, less<>> localSlots;  // of the procedure being resolved
+    map<const ASTNode*, vector<string>> locals;
 
 public:
-    Interpreter() : gotoFlag(false) {
-        srand(time(0));
+    explicit Resolver(vector<string>& names) : names(names) {}
+
+    // Slots already given out are kept, so a program can be resolved a
+    // piece at a time (--repl)
+    void resolve(ASTNode* program) {
+        locals.clear();
+        for (auto& child : program->children) {
+            if (child && child->type != NODE_DEFINE) visit(child);
+        }
+        for (auto& child : program->children) {
+            if (child && child->type == NODE_DEFINE) resolveProcedure(child);
+        }
     }
 
-    void run(shared_ptr<ASTNode> prog) {
-        program = prog;
-        // First pass: collect labels
-        collectLabels(program);
-        // Second pass: execute
-        execute(program);
+    // Gives back the slots from `from` on, for a --repl entry that was
+    // taken back out
+    void forget(size_t from) {
+        for (size_t i = from; i < names.size(); i++) {
+            auto it = slots.find(names[i]);
+            if (it != slots.end() && it->second == (int)i) slots.erase(it);
+        }
+    }
+
+    // Resolves a NODE_DEFINE again against the global slots given out
+    // since (--repl)
+    void resolveAgain(ASTNode* define) {
+        locals[define].clear();
+        resolveProcedure(define);
     }
 
+    // Local slot -> name for a NODE_DEFINE; parameters come first
+    const vector<string>& localsOf(const ASTNode* define) { return locals[define]; }
+
 private:
-    void collectLabels(shared_ptr<ASTNode> node, size_t idx = 0) {
-        if (!node) return;
-        if (node->type == NODE_PROGRAM) {
-            for (size_t i = 0; i < node->children.size(); i++) {
-                if (node->children[i]->type == NODE_LABEL) {
-                    labels[node->children[i]->value] = i;
-                }
-            }
-        }
+    void resolveProcedure(ASTNode* define) {
+        vector<string>& own = locals[define];
+        localSlots.clear();
+        for (size_t i = 0; i + 1 < define->children.size(); i++) addLocal(define->children[i]->value, own);
+        if (!define->children.empty()) collectAssigned(define->children.back(), own);
+        visit(define);
+        localSlots.clear();
     }
 
-    void execute(shared_ptr<ASTNode> node) {
+    void collectAssigned(const ASTNode* node, vector<string>& own) {
         if (!node) return;
-
-        if (node->type == NODE_PROGRAM) {
-            for (size_t i = 0; i < node->children.size(); i++) {
-                execute(node->children[i]);
-                
-                if (gotoFlag) {
-                    if (labels.find(gotoTarget) != labels.end()) {
-                        i = labels[gotoTarget] - 1; // -1 because loop will increment
-                        gotoFlag = false;
-                    } else {
-                        cerr << "Label not found: " << gotoTarget << endl;
-                        gotoFlag = false;
-                    }
-                }
-            }
-        }
-        else if (node->type == NODE_LET) {
-            Value val = evalValue(node->children[0]);
-            variables[node->value] = val;
-        }
-        else if (node->type == NODE_PRINT) {
-            Value val = evalValue(node->children[0]);
-            if (val.is_string) {
-                cout << val.str_value << endl;
-            } else {
-                cout << val.num_value << endl;
-            }
-        }
-        else if (node->type == NODE_WRITE) {
-            Value val = evalValue(node->children[0]);
-            if (val.is_string) {
-                cout << val.str_value;
-            } else {
-                cout << val.num_value;
-            }
-        }
-        else if (node->type == NODE_CLEAR) {
-            cout << "\033[2J\033[H" << flush;
-        }
-        else if (node->type == NODE_WHEN) {
-            Value cond = evalValue(node->children[0]);
-            double condNum = cond.is_string ? (cond.str_value.empty() ? 0 : 1) : cond.num_value;
-            if (condNum != 0) {
-                execute(node->children[1]); // then block
-            } else if (node->children.size() > 2) {
-                execute(node->children[2]); // else block
-            }
-        }
-        else if (node->type == NODE_REPEAT) {
-            Value countVal = evalValue(node->children[0]);
-            int count = (int)countVal.num_value;
-            for (int i = 0; i < count; i++) {
-                execute(node->children[1]);
-                if (gotoFlag) return; // Return to allow goto to propagate
-            }
-        }
-        else if (node->type == NODE_LOOP_WHILE) {
-            Value condVal = evalValue(node->children[0]);
-            while (condVal.num_value != 0) {
-                execute(node->children[1]);
-                if (gotoFlag) return; // Return to allow goto to propagate
-                condVal = evalValue(node->children[0]);
-            }
-        }
-        else if (node->type == NODE_LOOP_FOR) {
-            Value startVal = evalValue(node->children[0]);
-            Value endVal = evalValue(node->children[1]);
-            double start = startVal.num_value;
-            double end = endVal.num_value;
-            for (double i = start; i <= end; i++) {
-                variables[node->value] = Value(i);
-                execute(node->children[2]);
-                if (gotoFlag) return; // Return to allow goto to propagate
-            }
-        }
-        else if (node->type == NODE_GOTO) {
-            gotoTarget = node->value;
-            gotoFlag = true;
-        }
-        else if (node->type == NODE_BLOCK) {
-            for (auto& child : node->children) {
-                execute(child);
-                if (gotoFlag) return; // Return to allow goto to propagate
-            }
+        if ((node->type == NODE_LET || node->type == NODE_LOOP_FOR || node->type == NODE_LOOP_EACH) &&
+            !slots.count(node->value)) {
+            addLocal(node->value, own);
         }
+        for (auto& child : node->children) collectAssigned(child, own);
     }
-Value evalValue(shared_ptr<ASTNode> node) {
-        if (!node) return Value(0.0);
 
-        if (node->type == NODE_NUMBER) {
-            return Value(stod(node->value));
-        }
-        if (node->type == NODE_STRING) {
-            return Value(node->value);
-        }
-        if (node->type == NODE_IDENT) {
-            if (variables.find(node->value) != variables.end()) {
-                return variables[node->value];
-            }
-            cerr << "Undefined variable: " << node->value << endl;
-            return Value(0.0);
-        }
-        if (node->type == NODE_INPUT) {
-            if (node->children.size() > 0 && node->children[0]->type == NODE_STRING) {
-                cout << node->children[0]->value;
-            }
-            string input;
-            getline(cin, input);
-            return Value(input); // Return as string
-        }
-        if (node->type == NODE_INPUT_NUM) {
-            if (node->children.size() > 0 && node->children[0]->type == NODE_STRING) {
-                cout << node->children[0]->value;
-            }
-            string input;
-            getline(cin, input);
-            try {
-                return Value(stod(input));
-            } catch (...) {
-                cerr << "Invalid input - please enter a number" << endl;
-                return Value(0.0);
-            }
-        }
-        if (node->type == NODE_CALL && node->value == "random") {
-            Value minVal = evalValue(node->children[0]);
-            Value maxVal = evalValue(node->children[1]);
-            int min = (int)minVal.num_value;
-            int max = (int)maxVal.num_value;
-            return Value((double)(min + (rand() % (max - min + 1))));
-        }
-        if (node->type == NODE_CALL && node->value == "sqrt") {
-            Value val = evalValue(node->children[0]);
-            if (val.is_string) {
-                cerr << "sqrt() requires a number, not a string" << endl;
-                return Value(0.0);
-            }
-            return Value(sqrt(val.num_value));
-        }
-        if (node->type == NODE_CALL && node->value == "pow") {
-            Value base = evalValue(node->children[0]);
-            Value exp = evalValue(node->children[1]);
-            if (base.is_string || exp.is_string) {
-                cerr << "pow() requires numbers, not strings" << endl;
-                return Value(0.0);
-            }
-            return Value(pow(base.num_value, exp.num_value));
-        }
-        if (node->type == NODE_CALL && node->value == "abs") {
-            Value val = evalValue(node->children[0]);
-            if (val.is_string) {
-                cerr << "abs() requires a number, not a string" << endl;
-                return Value(0.0);
-            }
-            return Value(fabs(val.num_value));
-        }
-        if (node->type == NODE_CALL && node->value == "floor") {
-            Value val = evalValue(node->children[0]);
-            if (val.is_string) {
-                cerr << "floor() requires a number, not a string" << endl;
-                return Value(0.0);
-            }
-            return Value(floor(val.num_value));
-        }
-        if (node->type == NODE_CALL && node->value == "ceil") {
-            Value val = evalValue(node->children[0]);
-            if (val.is_string) {
-                cerr << "ceil() requires a number, not a string" << endl;
-                return Value(0.0);
-            }
-            return Value(ceil(val.num_value));
-        }
-        if (node->type == NODE_UNARY) {
-            Value val = evalValue(node->children[0]);
-            if (val.is_string) {
-                cerr << "Unary operator requires a number, not a string" << endl;
-                return Value(0.0);
-            }
-            if (node->value == "-") {
-                return Value(-val.num_value);
-            }
-            return Value(0.0);
+    void addLocal(string_view name, vector<string>& own) {
+        if (localSlots.count(name)) return;
+        own.emplace_back(name);
+        localSlots.emplace(name, (int)own.size() - 1);
+    }
+
+    void visit(ASTNode* node) {
+        if (!node) return;
+        if (node->type == NODE_LET || node->type == NODE_IDENT || node->type == NODE_LOOP_FOR ||
+            node->type == NODE_INDEX || node->type == NODE_LET_INDEX || node->type == NODE_PUSH ||
+            node->type == NODE_FILL || node->type == NODE_REMOVE || node->type == NODE_LOOP_EACH) {
+            auto local = localSlots.find(node->value);
+            node->local = local != localSlots.end();
+            node->slot = node->local ? local->second : slotFor(node->value);
         }
-        if (node->type == NODE_BINOP) {
-            Value left = evalValue(node->children[0]);
-            Value right = evalValue(node->children[1]);
+        for (auto& child : node->children) visit(child);
+    }
 
-            // String concatenation
-            if (node->value == "+" && (left.is_string || right.is_string)) {
-                string leftStr = left.is_string ? left.str_value : to_string((int)left.num_value);
-                string rightStr = right.is_string ? right.str_value : to_string((int)right.num_value);
-                return Value(leftStr + rightStr);
-            }
+    int slotFor(string_view name) {
+        auto it = slots.find(name);
+        if (it != slots.end()) return it->second;
+        names.emplace_back(name);
+        return slots[names.back()] = (int)names.size() - 1;
+    }
+};
 
-            // String comparison
-            if (left.is_string && right.is_string) {
-                if (node->value == "==") return Value(left.str_value == right.str_value ? 1.0 : 0.0);
-                if (node->value == "!=") return Value(left.str_value != right.str_value ? 1.0 : 0.0);
-                cerr << "Operator " << node->value << " not supported for strings" << endl;
-                return Value(0.0);
-            }
+// Bytes held by the strings, arrays and dictionaries made on this thread,
+// and the most they may hold (--max-memory). Going over throws bad_alloc,
+// which stops the program.
+thread_local size_t heapBytes = 0;
+thread_local size_t heapLimit = SIZE_MAX;
 
-            // Numeric operations
-            if (!left.is_string && !right.is_string) {
-                if (node->value == "+") return Value(left.num_value + right.num_value);
-                if (node->value == "-") return Value(left.num_value - right.num_value);
-                if (node->value == "*") return Value(left.num_value * right.num_value);
-                if (node->value == "/") return Value(left.num_value / right.num_value);
-                if (node->value == "%") return Value((double)((int)left.num_value % (int)right.num_value));
-                if (node->value == "==") return Value(left.num_value == right.num_value ? 1.0 : 0.0);
-                if (node->value == "!=") return Value(left.num_value != right.num_value ? 1.0 : 0.0);
-                if (node->value == "<") return Value(left.num_value < right.num_value ? 1.0 : 0.0);
-                if (node->value == ">") return Value(left.num_value > right.num_value ? 1.0 : 0.0);
-                if (node->value == "<=") return Value(left.num_value <= right.num_value ? 1.0 : 0.0);
-                if (node->value == ">=") return Value(left.num_value >= right.num_value ? 1.0 : 0.0);
-            }
+inline void countHeap(size_t bytes) {
+    heapBytes += bytes;
+    if (heapBytes > heapLimit) throw bad_alloc();
+}
 
-            cerr << "Type mismatch in operation" << endl;
-            return Value(0.0);
+// Allocator for the buffers of arrays and dictionaries that keeps heapBytes
+template <typename T>
+struct Counted {
+    using value_type = T;
+
+    Counted() = default;
+    template <typename U>
+    Counted(const Counted<U>&) {}
+
+    T* allocate(size_t n) {
+        try {
+            countHeap(n * sizeof(T));
+            return std::allocator<T>().allocate(n);
+        } catch (...) {
+            heapBytes -= n * sizeof(T);
+            throw;
         }
-
-        return Value(0.0);
     }
+    void deallocate(T* p, size_t n) {
+        heapBytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+    template <typename U>
+    bool operator==(const Counted<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const Counted<U>&) const { return false; }
+};
 
-    double eval(shared_ptr<ASTNode> node) {
-        Value val = evalValue(node);
-        return val.num_value;
+// Heap body for strings too long to store inline; shared between Values
+// and freed when the last reference goes away
+struct StringRep {
+    int refs;
+    string text;
+    size_t hash = 0;  // dictionary key hash, 0 until first needed
+
+    StringRep(string&& s) : refs(1), text(std::move(s)) {
+        try {
+            countHeap(text.capacity());
+        } catch (...) {
+            heapBytes -= text.capacity();
+            throw;
+        }
     }
+    ~StringRep() { heapBytes -= text.capacity(); }
 };
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        cerr << "Usage: flow <filename.flow>" << endl;
-        return 1;
+struct ArrayRep;
+struct DictRep;
+
+// Kept out of line so the paths that call it stay small
+#if defined(__GNUC__) || defined(__clang__)
+#define COLD_PATH __attribute__((noinline, cold))
+#else
+#define COLD_PATH
+#endif
+
+// Value type for variables: a 16-byte tagged union. Numbers never touch
+// string machinery, short strings are stored inline, and longer strings
+// and arrays are reference counted so copies share one buffer.
+class Value {
+    // The kinds from HEAP_STRING on hold a reference to a shared body
+    enum Kind : unsigned char { NUMBER, SMALL_STRING, HEAP_STRING, ARRAY, DICT };
+    static const size_t SMALL_CAPACITY = 14;
+
+    // number or StringRep* in the first 8 bytes; small strings use
+    // data[0..13] with their length in data[14]
+    alignas(8) char data[15];
+    Kind kind;
+
+public:
+    Value() : kind(NUMBER) { setRaw(0.0); }
+    Value(double n) : kind(NUMBER) { setRaw(n); }
+    Value(string_view s) { init(s); }
+    Value(const string& s) { init(s); }
+    Value(const char* s) { init(s); }
+    Value(string&& s) {
+        if (s.size() <= SMALL_CAPACITY) {
+            init(s);
+        } else {
+            kind = HEAP_STRING;
+            setRaw(new StringRep(std::move(s)));
+        }
     }
+    // Take over a freshly made array or dictionary (refs == 1)
+    explicit Value(ArrayRep* array) : kind(ARRAY) { setRaw(array); }
+    explicit Value(DictRep* dict) : kind(DICT) { setRaw(dict); }
 
-    // Read file
-    ifstream file(argv[1]);
-    if (!file) {
-        cerr << "Could not open file: " << argv[1] << endl;
-        return 1;
+    Value(const Value& other) : kind(other.kind) {
+        memcpy(data, other.data, sizeof(data));
+        retain();
     }
 
-    stringstream buffer;
-    buffer << file.rdbuf();
-    string source = buffer.str();
+    Value(Value&& other) noexcept : kind(other.kind) {
+        memcpy(data, other.data, sizeof(data));
+        other.kind = NUMBER;
+    }
 
-    // Tokenize
-    Lexer lexer(source);
+    Value& operator=(const Value& other) {
+        other.retain();
+        release();
+        kind = other.kind;
+        memcpy(data, other.data, sizeof(data));
+        return *this;
+    }
+
+    Value& operator=(Value&& other) noexcept {
+        if (this != &other) {
+            release();
+            kind = other.kind;
+            memcpy(data, other.data, sizeof(data));
+            other.kind = NUMBER;
+        }
+        return *this;
+    }
+
+    ~Value() { release(); }
+
+    bool isNumber() const { return kind == NUMBER; }
+    bool isString() const { return kind == SMALL_STRING || kind == HEAP_STRING; }
+    bool isArray() const { return kind == ARRAY; }
+    bool isDict() const { return kind == DICT; }
+
+    // For error messages about non-numbers
+    const char* kindName() const {
+        return kind == ARRAY ? "an array" : kind == DICT ? "a dictionary" : "a string";
+    }
+
+    // Strings, arrays and dictionaries read as 0, matching how loops and
+    // random() treat them
+    double number() const {
+        if (kind != NUMBER) return 0;
+        double n;
+        memcpy(&n, data, sizeof(n));
+        return n;
+    }
+
+    string_view text() const {
+        if (kind == SMALL_STRING) return string_view(data, (unsigned char)data[SMALL_CAPACITY]);
+        if (kind == HEAP_STRING) return rep()->text;
+        return string_view();
+    }
+
+    void setNumber(double n) {
+        release();
+        kind = NUMBER;
+        setRaw(n);
+    }
+
+    const ArrayRep& items() const { return *arrayRep(); }
+    const DictRep& dict() const { return *dictRep(); }
+
+    // For changing an array or dictionary: copies it first if another Value
+    // shares it
+    inline ArrayRep& mutableItems();
+    inline DictRep& mutableDict();
+
+    // Hash of a number or string dictionary key. Long strings keep theirs,
+    // so a key used over and over is only hashed once.
+    size_t hashKey() const {
+        if (kind == NUMBER) {
+            double n = number();
+            if (n == 0) n = 0; // -0 and 0 are the same key
+            uint64_t bits;
+            memcpy(&bits, &n, sizeof(bits));
+            return mixHash(bits);
+        }
+        if (kind == HEAP_STRING) {
+            if (rep()->hash == 0) rep()->hash = hashText(rep()->text) | 1;
+            return rep()->hash;
+        }
+        return hashText(text()) | 1;
+    }
+
+    bool sameKey(const Value& other) const {
+        if (kind == NUMBER || other.kind == NUMBER) return kind == other.kind && number() == other.number();
+        return text() == other.text();
+    }
+
+    // Appends in place when this Value is the only owner of its buffer, so
+    // growing a string one piece at a time is linear overall
+    void append(string_view s) {
+        if (kind == HEAP_STRING && rep()->refs == 1) {
+            size_t capacity = rep()->text.capacity();
+            rep()->text.append(s);
+            rep()->hash = 0;
+            countHeap(rep()->text.capacity() - capacity);
+            return;
+        }
+        string_view current = text();
+        string joined;
+        joined.reserve(current.size() + s.size());
+        joined.append(current).append(s);
+        *this = Value(std::move(joined));
+    }
+
+private:
+    void init(string_view s) {
+        if (s.size() <= SMALL_CAPACITY) {
+            kind = SMALL_STRING;
+            memcpy(data, s.data(), s.size());
+            data[SMALL_CAPACITY] = (char)s.size();
+        } else {
+            kind = HEAP_STRING;
+            setRaw(new StringRep(string(s)));
+        }
+    }
+
+    StringRep* rep() const {
+        StringRep* r;
+        memcpy(&r, data, sizeof(r));
+        return r;
+    }
+
+    ArrayRep* arrayRep() const {
+        ArrayRep* r;
+        memcpy(&r, data, sizeof(r));
+        return r;
+    }
+
+    DictRep* dictRep() const {
+        DictRep* r;
+        memcpy(&r, data, sizeof(r));
+        return r;
+    }
+
+    static size_t mixHash(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        return x ^ (x >> 33);
+    }
+
+    // FNV-1a
+    static size_t hashText(string_view s) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (unsigned char c : s) h = (h ^ c) * 0x100000001b3ULL;
+        return mixHash(h);
+    }
+
+    template <typename T>
+    void setRaw(T raw) { memcpy(data, &raw, sizeof(raw)); }
+
+    inline void retain() const;
+
+    // Numbers and inline strings have nothing to free; only a shared body
+    // goes through the out-of-line teardown. It is handed the body rather
+    // than this, so a temporary Value can stay in registers.
+    void release() {
+        if (kind >= HEAP_STRING) releaseShared(kind, rep());
+        kind = NUMBER;
+    }
+    static void releaseShared(Kind kind, void* body);
+};
+
+// Array body. Numbers are kept in a plain double buffer; the first string
+// stored converts the array to a vector of Values.
+struct ArrayRep {
+    int refs = 1;
+    bool mixed = false;
+    vector<double, Counted<double>> numbers;
+    vector<Value, Counted<Value>> values;  // used once mixed
+
+    ArrayRep(size_t size = 0) : numbers(size, 0.0) {}
+
+    size_t size() const { return mixed ? values.size() : numbers.size(); }
+
+    Value get(size_t i) const { return mixed ? values[i] : Value(numbers[i]); }
+
+    void set(size_t i, const Value& v) {
+        if (!mixed && v.isNumber()) {
+            numbers[i] = v.number();
+            return;
+        }
+        makeMixed();
+        values[i] = v;
+    }
+
+    void push(const Value& v) {
+        if (!mixed && v.isNumber()) {
+            numbers.push_back(v.number());
+            return;
+        }
+        makeMixed();
+        values.push_back(v);
+    }
+
+    void fill(const Value& v) {
+        if (v.isNumber()) {
+            numbers.assign(size(), v.number());
+            values.clear();
+            mixed = false;
+            return;
+        }
+        makeMixed();
+        std::fill(values.begin(), values.end(), v);
+    }
+
+private:
+    void makeMixed() {
+        if (mixed) return;
+        values.assign(numbers.begin(), numbers.end());
+        numbers.clear();
+        numbers.shrink_to_fit();
+        mixed = true;
+    }
+};
+
+// Dictionary body: an open-addressing hash table keyed by numbers and
+// strings. Entries are kept in insertion order, which is the order loop
+// each visits them; index holds entry positions, probed linearly. Each
+// entry stores its key's hash so growing the table never rehashes strings.
+struct DictRep {
+    struct Entry {
+        Value key;
+        Value value;
+        size_t hash;
+        bool removed;
+    };
+    static constexpr int32_t EMPTY = -1;
+    static constexpr int32_t REMOVED = -2;
+
+    int refs = 1;
+    vector<Entry, Counted<Entry>> entries;
+    vector<int32_t, Counted<int32_t>> index;  // size is a power of two, or 0 before the first insert
+    size_t count = 0;       // entries not removed
+
+    // Position of key in entries, or -1
+    long find(const Value& key) const {
+        if (index.empty()) return -1;
+        size_t hash = key.hashKey(), mask = index.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            int32_t at = index[i];
+            if (at == EMPTY) return -1;
+            if (at >= 0 && entries[at].hash == hash && entries[at].key.sameKey(key)) return at;
+        }
+    }
+
+    void set(const Value& key, const Value& value) {
+        long at = find(key);
+        if (at >= 0) {
+            entries[at].value = value;
+            return;
+        }
+        // Removed entries still occupy probe slots until the next rebuild
+        if ((entries.size() + 1) * 3 > index.size() * 2) rebuild();
+        size_t hash = key.hashKey(), mask = index.size() - 1;
+        size_t i = hash & mask;
+        while (index[i] >= 0) i = (i + 1) & mask;
+        // The push can throw under --max-memory; the index only learns of
+        // the entry once it is there
+        entries.push_back({key, value, hash, false});
+        index[i] = (int32_t)entries.size() - 1;
+        count++;
+    }
+
+    bool remove(const Value& key) {
+        long at = find(key);
+        if (at < 0) return false;
+        size_t mask = index.size() - 1;
+        for (size_t i = entries[at].hash & mask;; i = (i + 1) & mask) {
+            if (index[i] == at) {
+                index[i] = REMOVED;
+                break;
+            }
+        }
+        entries[at].removed = true;
+        entries[at].key = Value();
+        entries[at].value = Value();
+        count--;
+        return true;
+    }
+
+private:
+    // Drops removed entries and resizes index to keep it at most 1/2 full.
+    // The new index is allocated first, so running out of memory leaves the
+    // table as it was.
+    void rebuild() {
+        size_t size = 8;
+        while (size < (count + 1) * 2) size *= 2;
+        vector<int32_t, Counted<int32_t>> fresh(size, EMPTY);
+        size_t live = 0;
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (!entries[i].removed) entries[live++] = std::move(entries[i]);
+        }
+        entries.resize(live);
+        index.swap(fresh);
+        for (size_t e = 0; e < live; e++) {
+            size_t i = entries[e].hash & (size - 1);
+            while (index[i] != EMPTY) i = (i + 1) & (size - 1);
+            index[i] = (int32_t)e;
+        }
+    }
+};
+
+void Value::retain() const {
+    if (kind == HEAP_STRING) rep()->refs++;
+    else if (kind == ARRAY) arrayRep()->refs++;
+    else if (kind == DICT) dictRep()->refs++;
+}
+
+COLD_PATH void Value::releaseShared(Kind kind, void* body) {
+    if (kind == HEAP_STRING) {
+        StringRep* string = static_cast<StringRep*>(body);
+        if (--string->refs == 0) delete string;
+    } else if (kind == ARRAY) {
+        ArrayRep* array = static_cast<ArrayRep*>(body);
+        if (--array->refs == 0) delete array;
+    } else if (kind == DICT) {
+        DictRep* dict = static_cast<DictRep*>(body);
+        if (--dict->refs == 0) delete dict;
+    }
+}
+
+ArrayRep& Value::mutableItems() {
+    ArrayRep* array = arrayRep();
+    if (array->refs > 1) {
+        ArrayRep* copy = new ArrayRep(*array);
+        copy->refs = 1;
+        array->refs--;
+        setRaw(copy);
+        array = copy;
+    }
+    return *array;
+}
+
+DictRep& Value::mutableDict() {
+    DictRep* dict = dictRep();
+    if (dict->refs > 1) {
+        DictRep* copy = new DictRep(*dict);
+        copy->refs = 1;
+        dict->refs--;
+        setRaw(copy);
+        dict = copy;
+    }
+    return *dict;
+}
+
+// Whole-array numeric kernels. Each comes in a portable scalar version and,
+// on x86 with GCC or Clang, an AVX2 version used when the CPU supports it
+// (--no-simd forces the scalar ones). There is no SSE2 version: its two-lane
+// code measured slower than the scalar loops. Sums and dot products keep
+// four partial sums in every version and combine them the same way, so
+// results do not depend on which version ran.
+struct ArrayKernels {
+    const char* name;
+    void (*arith)(Operator op, double* out, const double* x, const double* y, size_t n);
+    // scalarFirst: out = s op x rather than x op s
+    void (*arithScalar)(Operator op, double* out, const double* x, double s, bool scalarFirst, size_t n);
+    double (*sum)(const double* x, size_t n);
+    double (*dot)(const double* x, const double* y, size_t n);
+    double (*min)(const double* x, size_t n);  // n > 0
+    double (*max)(const double* x, size_t n);  // n > 0
+    void (*clamp)(double* out, const double* x, double lo, double hi, size_t n);
+};
+
+template <Operator op>
+inline double applyArith(double a, double b) {
+    if (op == OPR_ADD) return a + b;
+    if (op == OPR_SUB) return a - b;
+    if (op == OPR_MUL) return a * b;
+    return a / b;
+}
+
+template <Operator op>
+void scalarArith(double* out, const double* x, const double* y, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = applyArith<op>(x[i], y[i]);
+}
+
+template <Operator op>
+void scalarArithScalar(double* out, const double* x, double s, bool scalarFirst, size_t n) {
+    if (scalarFirst) {
+        for (size_t i = 0; i < n; i++) out[i] = applyArith<op>(s, x[i]);
+    } else {
+        for (size_t i = 0; i < n; i++) out[i] = applyArith<op>(x[i], s);
+    }
+}
+
+// Calls kernel<op> for the four element-wise operators
+#define ARITH_DISPATCH(kernel, ...)                                 \
+    switch (op) {                                                   \
+    case OPR_ADD: kernel<OPR_ADD>(__VA_ARGS__); break;              \
+    case OPR_SUB: kernel<OPR_SUB>(__VA_ARGS__); break;              \
+    case OPR_MUL: kernel<OPR_MUL>(__VA_ARGS__); break;              \
+    default: kernel<OPR_DIV>(__VA_ARGS__); break;                   \
+    }
+
+void scalarArithAny(Operator op, double* out, const double* x, const double* y, size_t n) {
+    ARITH_DISPATCH(scalarArith, out, x, y, n)
+}
+
+void scalarArithScalarAny(Operator op, double* out, const double* x, double s, bool scalarFirst, size_t n) {
+    ARITH_DISPATCH(scalarArithScalar, out, x, s, scalarFirst, n)
+}
+
+double scalarSum(const double* x, size_t n) {
+    double acc[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int j = 0; j < 4; j++) acc[j] += x[i + j];
+    }
+    double total = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+    for (; i < n; i++) total += x[i];
+    return total;
+}
+
+double scalarDot(const double* x, const double* y, size_t n) {
+    double acc[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int j = 0; j < 4; j++) acc[j] += x[i + j] * y[i + j];
+    }
+    double total = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+    for (; i < n; i++) total += x[i] * y[i];
+    return total;
+}
+
+double scalarMin(const double* x, size_t n) {
+    double best = x[0];
+    for (size_t i = 1; i < n; i++) best = x[i] < best ? x[i] : best;
+    return best;
+}
+
+double scalarMax(const double* x, size_t n) {
+    double best = x[0];
+    for (size_t i = 1; i < n; i++) best = x[i] > best ? x[i] : best;
+    return best;
+}
+
+void scalarClamp(double* out, const double* x, double lo, double hi, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        double v = x[i] < lo ? lo : x[i];
+        out[i] = v > hi ? hi : v;
+    }
+}
+
+const ArrayKernels SCALAR_KERNELS = {
+    "scalar", scalarArithAny, scalarArithScalarAny, scalarSum, scalarDot, scalarMin, scalarMax, scalarClamp,
+};
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FLOW_X86_KERNELS 1
+
+// Four doubles: one AVX2 register. The kernel bodies are written against
+// this type and inlined into the AVX2 entry points, which decide the
+// instructions they compile to.
+typedef double Lanes __attribute__((vector_size(32)));
+#define LANE_KERNEL __attribute__((always_inline)) inline
+
+// Lanes only cross calls that are always inlined, so the AVX argument ABI
+// GCC warns about never applies (the warning is issued at the end of the
+// file, so it stays off from here on)
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+LANE_KERNEL Lanes loadLanes(const double* p) {
+    Lanes v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+LANE_KERNEL void storeLanes(double* p, const Lanes& v) { memcpy(p, &v, sizeof(v)); }
+
+LANE_KERNEL Lanes splat(double s) { return Lanes{s, s, s, s}; }
+
+template <Operator op>
+LANE_KERNEL Lanes applyArith(const Lanes& a, const Lanes& b) {
+    if (op == OPR_ADD) return a + b;
+    if (op == OPR_SUB) return a - b;
+    if (op == OPR_MUL) return a * b;
+    return a / b;
+}
+
+template <Operator op>
+LANE_KERNEL void lanesArith(double* out, const double* x, const double* y, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) storeLanes(out + i, applyArith<op>(loadLanes(x + i), loadLanes(y + i)));
+    for (; i < n; i++) out[i] = applyArith<op>(x[i], y[i]);
+}
+
+template <Operator op>
+LANE_KERNEL void lanesArithScalar(double* out, const double* x, double s, bool scalarFirst, size_t n) {
+    Lanes sv = splat(s);
+    size_t i = 0;
+    if (scalarFirst) {
+        for (; i + 4 <= n; i += 4) storeLanes(out + i, applyArith<op>(sv, loadLanes(x + i)));
+        for (; i < n; i++) out[i] = applyArith<op>(s, x[i]);
+    } else {
+        for (; i + 4 <= n; i += 4) storeLanes(out + i, applyArith<op>(loadLanes(x + i), sv));
+        for (; i < n; i++) out[i] = applyArith<op>(x[i], s);
+    }
+}
+
+LANE_KERNEL double lanesSum(const double* x, size_t n) {
+    Lanes acc = splat(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) acc += loadLanes(x + i);
+    double total = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+    for (; i < n; i++) total += x[i];
+    // Which NaN an addition passes on depends on operand order, which the
+    // compiler may swap; redo a NaN total the scalar way so its sign matches
+    return total == total ? total : scalarSum(x, n);
+}
+
+LANE_KERNEL double lanesDot(const double* x, const double* y, size_t n) {
+    Lanes acc = splat(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) acc += loadLanes(x + i) * loadLanes(y + i);
+    double total = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+    for (; i < n; i++) total += x[i] * y[i];
+    return total == total ? total : scalarDot(x, y, n);
+}
+
+// Gives what the scalar loop gives: NaN when x[0] is NaN (nothing compares
+// less than it), other NaNs skipped, and of equal zeros the first one
+template <bool wantMin>
+LANE_KERNEL double lanesExtreme(const double* x, size_t n) {
+    if (n < 4 || x[0] != x[0]) return wantMin ? scalarMin(x, n) : scalarMax(x, n);
+    // Every lane starts from x[0], so a NaN element is never picked up
+    Lanes best = splat(x[0]);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        Lanes v = loadLanes(x + i);
+        best = wantMin ? (v < best ? v : best) : (v > best ? v : best);
+    }
+    double result = best[0];
+    for (int j = 1; j < 4; j++) result = wantMin ? (best[j] < result ? best[j] : result) : (best[j] > result ? best[j] : result);
+    for (; i < n; i++) result = wantMin ? (x[i] < result ? x[i] : result) : (x[i] > result ? x[i] : result);
+    if (result == 0) {
+        // -0 and 0 compare equal; the scalar loop keeps whichever came first
+        for (i = 0; x[i] != 0; i++) {}
+        result = x[i];
+    }
+    return result;
+}
+
+LANE_KERNEL void lanesClamp(double* out, const double* x, double lo, double hi, size_t n) {
+    Lanes low = splat(lo), high = splat(hi);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        Lanes v = loadLanes(x + i);
+        v = v < low ? low : v;
+        storeLanes(out + i, v > high ? high : v);
+    }
+    for (; i < n; i++) {
+        double v = x[i] < lo ? lo : x[i];
+        out[i] = v > hi ? hi : v;
+    }
+}
+
+// One set of entry points per instruction set
+#define DEFINE_LANE_KERNELS(isa, target)                                                                     \
+    target void isa##Arith(Operator op, double* out, const double* x, const double* y, size_t n) {          \
+        ARITH_DISPATCH(lanesArith, out, x, y, n)                                                             \
+    }                                                                                                        \
+    target void isa##ArithScalar(Operator op, double* out, const double* x, double s, bool first, size_t n) { \
+        ARITH_DISPATCH(lanesArithScalar, out, x, s, first, n)                                                \
+    }                                                                                                        \
+    target double isa##Sum(const double* x, size_t n) { return lanesSum(x, n); }                             \
+    target double isa##Dot(const double* x, const double* y, size_t n) { return lanesDot(x, y, n); }         \
+    target double isa##Min(const double* x, size_t n) { return lanesExtreme<true>(x, n); }                   \
+    target double isa##Max(const double* x, size_t n) { return lanesExtreme<false>(x, n); }                  \
+    target void isa##Clamp(double* out, const double* x, double lo, double hi, size_t n) {                   \
+        lanesClamp(out, x, lo, hi, n);                                                                       \
+    }                                                                                                        \
+    const ArrayKernels isa##_KERNELS = {                                                                     \
+        #isa, isa##Arith, isa##ArithScalar, isa##Sum, isa##Dot, isa##Min, isa##Max, isa##Clamp,              \
+    };
+
+DEFINE_LANE_KERNELS(avx2, __attribute__((target("avx2"))))
+#endif
+
+// The kernels used by the interpreter; chosen once at startup, before any
+// interpreter runs, and only read after that
+const ArrayKernels* arrayKernels = &SCALAR_KERNELS;
+
+void selectArrayKernels(bool simd) {
+    arrayKernels = &SCALAR_KERNELS;
+#ifdef FLOW_X86_KERNELS
+    if (!simd) return;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) arrayKernels = &avx2_KERNELS;
+#else
+    (void)simd;
+#endif
+}
+
+// Element-wise + - * / on arrays of numbers: two arrays of the same length,
+// or an array and a number on either side. The result replaces left,
+// reusing its buffer when no other Value shares it. Returns false after
+// reporting an error.
+bool arrayArithmetic(Operator op, Value& left, const Value& right) {
+    const char* symbol = operatorSymbol(op);
+    if (op != OPR_ADD && op != OPR_SUB && op != OPR_MUL && op != OPR_DIV) {
+        *diagnostics << "Operator " << symbol << " not supported for arrays" << endl;
+        return false;
+    }
+    const Value& array = left.isArray() ? left : right;
+    const Value& other = left.isArray() ? right : left;
+    if (array.items().mixed || !(other.isNumber() || (other.isArray() && !other.items().mixed))) {
+        *diagnostics << "Operator " << symbol << " requires arrays of numbers" << endl;
+        return false;
+    }
+    size_t n = array.items().size();
+    if (other.isArray() && other.items().size() != n) {
+        *diagnostics << "Arrays must be the same length for " << symbol << " (" << n << " and " << other.items().size()
+             << ")" << endl;
+        return false;
+    }
+
+    ArrayRep* fresh = nullptr;
+    double* out;
+    if (left.isArray() && left.items().refs == 1) {
+        out = left.mutableItems().numbers.data();
+    } else {
+        fresh = new ArrayRep(n);
+        out = fresh->numbers.data();
+    }
+    if (other.isArray()) {
+        arrayKernels->arith(op, out, left.items().numbers.data(), right.items().numbers.data(), n);
+    } else {
+        arrayKernels->arithScalar(op, out, array.items().numbers.data(), other.number(), !left.isArray(), n);
+    }
+    if (fresh) left = Value(fresh);
+    return true;
+}
+
+// Binary operators, shared by the bytecode VM and the optimizer so constant
+// folding gives exactly the runtime result
+Value binaryOp(Operator op, const Value& left, const Value& right) {
+    if (left.isDict() || right.isDict()) {
+        *diagnostics << "Operator " << operatorSymbol(op) << " not supported for dictionaries" << endl;
+        return Value(0.0);
+    }
+    if (left.isArray() || right.isArray()) {
+        Value result = left;
+        return arrayArithmetic(op, result, right) ? result : Value(0.0);
+    }
+
+    // String concatenation
+    if (op == OPR_ADD && (left.isString() || right.isString())) {
+        string leftNum = left.isString() ? string() : to_string((int)left.number());
+        string rightNum = right.isString() ? string() : to_string((int)right.number());
+        string_view leftStr = left.isString() ? left.text() : string_view(leftNum);
+        string_view rightStr = right.isString() ? right.text() : string_view(rightNum);
+        string joined;
+        joined.reserve(leftStr.size() + rightStr.size());
+        joined.append(leftStr).append(rightStr);
+        return Value(std::move(joined));
+    }
+
+    // String comparison
+    if (left.isString() && right.isString()) {
+        if (op == OPR_EQ) return Value(left.text() == right.text() ? 1.0 : 0.0);
+        if (op == OPR_NEQ) return Value(left.text() != right.text() ? 1.0 : 0.0);
+        *diagnostics << "Operator " << operatorSymbol(op) << " not supported for strings" << endl;
+        return Value(0.0);
+    }
+
+    // Numeric operations
+    if (left.isNumber() && right.isNumber()) {
+        double l = left.number(), r = right.number();
+        switch (op) {
+        case OPR_ADD: return Value(l + r);
+        case OPR_SUB: return Value(l - r);
+        case OPR_MUL: return Value(l * r);
+        case OPR_DIV: return Value(l / r);
+        case OPR_MOD: return Value((double)((int)l % (int)r));
+        case OPR_EQ: return Value(l == r ? 1.0 : 0.0);
+        case OPR_NEQ: return Value(l != r ? 1.0 : 0.0);
+        case OPR_LT: return Value(l < r ? 1.0 : 0.0);
+        case OPR_GT: return Value(l > r ? 1.0 : 0.0);
+        case OPR_LTE: return Value(l <= r ? 1.0 : 0.0);
+        case OPR_GTE: return Value(l >= r ? 1.0 : 0.0);
+        default: break;
+        }
+    }
+
+    *diagnostics << "Type mismatch in operation" << endl;
+    return Value(0.0);
+}
+
+// let x = x + rhs where x already holds a string: same result as binaryOp,
+// but x's buffer is extended instead of copied
+void appendTo(Value& target, const Value& rhs) {
+    if (rhs.isArray() || rhs.isDict()) target = binaryOp(OPR_ADD, target, rhs);
+    else if (rhs.isString()) target.append(rhs.text());
+    else target.append(to_string((int)rhs.number()));
+}
+
+bool containsProcCall(const ASTNode* node) {
+    if (!node) return false;
+    if (node->type == NODE_PROC_CALL) return true;
+    for (auto& child : node->children) {
+        if (containsProcCall(child)) return true;
+    }
+    return false;
+}
+
+bool readsVariable(const ASTNode* node, const ASTNode* let) {
+    if (!node) return false;
+    if ((node->type == NODE_IDENT || node->type == NODE_INDEX) && node->slot == let->slot && node->local == let->local)
+        return true;
+    for (auto& child : node->children) {
+        if (readsVariable(child, let)) return true;
+    }
+    return false;
+}
+
+// The operands a, b, ... of `let x = x + a + b ...`, in order, or none when
+// the let is not an append to x. Each operand is appended as soon as it is
+// evaluated, so the ones after the first must not read x; a procedure call
+// in any of them could reassign x, so those keep the general order too.
+vector<ASTNode*> selfAppendOperands(const ASTNode* let) {
+    vector<ASTNode*> operands;
+    if (let->children.empty()) return operands;
+    const ASTNode* expr = let->children[0];
+    while (expr && expr->type == NODE_BINOP && expr->op == OPR_ADD && expr->children.size() == 2) {
+        operands.push_back(expr->children[1]);
+        expr = expr->children[0];
+    }
+    if (!expr || expr->type != NODE_IDENT || expr->slot != let->slot || expr->local != let->local) return {};
+    reverse(operands.begin(), operands.end());
+    for (size_t i = 0; i < operands.size(); i++) {
+        if (containsProcCall(operands[i]) || (i > 0 && readsVariable(operands[i], let))) return {};
+    }
+    return operands;
+}
+
+// Optimizer: folds constant expressions and drops branches whose condition
+// is known before the program runs (enabled with -O)
+class Optimizer {
+    AstArena& arena;  // where folded constants go
+    bool report;
+    int folds;
+
+public:
+    Optimizer(AstArena& arena, bool report = false) : arena(arena), report(report), folds(0) {}
+
+    void optimize(ASTNode* program) {
+        for (auto& child : program->children) child = optimizeStatement(child);
+        if (report) *diagnostics << "[fold] " << folds << " fold(s)" << endl;
+    }
+
+private:
+    static bool isConstant(const ASTNode* node) {
+        return node && (node->type == NODE_NUMBER || node->type == NODE_STRING);
+    }
+
+    static Value constantValue(const ASTNode* node) {
+        return node->type == NODE_STRING ? Value(node->value) : Value(node->number);
+    }
+
+    // (int) casts on these are only defined inside int range
+    static bool fitsInt(const Value& v) {
+        return v.isString() || (v.number() > -2147483648.0 && v.number() < 2147483648.0);
+    }
+
+    static bool containsLabel(const ASTNode* node) {
+        if (!node) return false;
+        if (node->type == NODE_LABEL) return true;
+        for (auto& child : node->children) {
+            if (containsLabel(child)) return true;
+        }
+        return false;
+    }
+
+    ASTNode* emptyBlock() {
+        auto block = arena.make<ASTNode>();
+        block->type = NODE_BLOCK;
+        return block;
+    }
+
+    ASTNode* makeConstant(const Value& v) {
+        auto node = arena.make<ASTNode>();
+        if (v.isString()) {
+            node->type = NODE_STRING;
+            node->value = arena.text(v.text());
+        } else {
+            node->type = NODE_NUMBER;
+            node->number = v.number();
+        }
+        return node;
+    }
+
+    ASTNode* optimizeStatement(ASTNode* node) {
+        if (!node) return node;
+
+        switch (node->type) {
+        case NODE_LET:
+        case NODE_PRINT:
+        case NODE_WRITE:
+        case NODE_RETURN:
+        case NODE_PROC_CALL:
+        case NODE_LET_INDEX:
+        case NODE_PUSH:
+        case NODE_FILL:
+        case NODE_REMOVE:
+        case NODE_LOOP_FOR:
+        case NODE_LOOP_EACH:
+            for (size_t i = 0; i < node->children.size(); i++) {
+                bool body = (node->type == NODE_LOOP_FOR && i == 2) || (node->type == NODE_LOOP_EACH && i == 1);
+                if (body) node->children[i] = optimizeStatement(node->children[i]);
+                else node->children[i] = foldExpr(node->children[i]);
+            }
+            return node;
+        case NODE_BLOCK:
+            for (auto& child : node->children) child = optimizeStatement(child);
+            return node;
+        case NODE_DEFINE:
+            if (!node->children.empty()) node->children.back() = optimizeStatement(node->children.back());
+            return node;
+        case NODE_WHEN: {
+            if (node->children.size() < 2) return node;
+            node->children[0] = foldExpr(node->children[0]);
+            for (size_t i = 1; i < node->children.size(); i++) {
+                node->children[i] = optimizeStatement(node->children[i]);
+            }
+            if (!isConstant(node->children[0])) return node;
+
+            Value cond = constantValue(node->children[0]);
+            bool taken = cond.isString() ? !cond.text().empty() : cond.number() != 0;
+            auto kept = taken ? node->children[1] : (node->children.size() > 2 ? node->children[2] : emptyBlock());
+            auto dropped = taken ? (node->children.size() > 2 ? node->children[2] : nullptr) : node->children[1];
+            if (containsLabel(dropped)) return node;
+            const char* outcome = taken ? " -> kept then branch"
+                                        : (node->children.size() > 2 ? " -> kept otherwise branch" : " -> removed");
+            note("when " + describe(node->children[0]) + outcome);
+            return kept;
+        }
+        case NODE_REPEAT:
+        case NODE_LOOP_WHILE: {
+            if (node->children.size() < 2) return node;
+            node->children[0] = foldExpr(node->children[0]);
+            node->children[1] = optimizeStatement(node->children[1]);
+            if (!isConstant(node->children[0]) || containsLabel(node->children[1])) return node;
+
+            // Both loops read number(), so a string condition or count is 0
+            Value v = constantValue(node->children[0]);
+            bool never = node->type == NODE_REPEAT ? (!fitsInt(v) || (int)v.number() <= 0) : v.number() == 0;
+            if (v.isString()) never = true;
+            if (!never) return node;
+            note(string(node->type == NODE_REPEAT ? "repeat " : "loop while ") + describe(node->children[0]) + " -> removed");
+            return emptyBlock();
+        }
+        default:
+            return node;
+        }
+    }
+
+    ASTNode* foldExpr(ASTNode* node) {
+        if (!node) return node;
+
+        // input() prompts are only printed when they are written as a plain string,
+        // so their children are left exactly as parsed
+        bool operands = node->type == NODE_PROC_CALL || node->type == NODE_ARRAY || node->type == NODE_INDEX ||
+                        node->type == NODE_DICT;
+        if (node->type != NODE_BINOP && node->type != NODE_UNARY && node->type != NODE_CALL && !operands) {
+            return node;
+        }
+        for (auto& child : node->children) child = foldExpr(child);
+        if (operands) return node;
+        for (auto& child : node->children) {
+            if (!isConstant(child)) return node;
+        }
+
+        Value result;
+        if (node->type == NODE_BINOP) {
+            if (node->children.size() < 2) return node;
+            Value left = constantValue(node->children[0]);
+            Value right = constantValue(node->children[1]);
+            bool concat = node->op == OPR_ADD && (left.isString() || right.isString());
+            if (concat) {
+                if (!fitsInt(left) || !fitsInt(right)) return node;
+            } else if (left.isString() && right.isString()) {
+                if (node->op != OPR_EQ && node->op != OPR_NEQ) return node;
+            } else if (left.isString() || right.isString()) {
+                return node; // type mismatch is reported at runtime
+            } else if (node->op == OPR_MOD && (!fitsInt(left) || !fitsInt(right) || (int)right.number() == 0)) {
+                return node;
+            }
+            result = binaryOp(node->op, left, right);
+        } else if (node->type == NODE_UNARY) {
+            if (node->children.empty() || node->children[0]->type != NODE_NUMBER) return node;
+            result = Value(-node->children[0]->number);
+        } else {
+            size_t arity = node->fn == FN_POW ? 2 : 1;
+            if (node->fn == FN_RANDOM || node->children.size() != arity) return node;
+            for (auto& child : node->children) {
+                if (child->type != NODE_NUMBER) return node;
+            }
+            double x = node->children[0]->number;
+            switch (node->fn) {
+            case FN_SQRT: result = Value(sqrt(x)); break;
+            case FN_POW: result = Value(pow(x, node->children[1]->number)); break;
+            case FN_ABS: result = Value(fabs(x)); break;
+            case FN_FLOOR: result = Value(floor(x)); break;
+            case FN_CEIL: result = Value(ceil(x)); break;
+            default: return node;
+            }
+        }
+
+        auto folded = makeConstant(result);
+        note(describe(node) + " -> " + describe(folded));
+        return folded;
+    }
+
+    void note(const string& what) {
+        folds++;
+        if (report) *diagnostics << "[fold] " << what << endl;
+    }
+
+    static string describe(const ASTNode* node) {
+        if (!node) return "?";
+        switch (node->type) {
+        case NODE_NUMBER: {
+            ostringstream out;
+            out << node->number;
+            return out.str();
+        }
+        case NODE_STRING:
+            return "\"" + string(node->value) + "\"";
+        case NODE_IDENT:
+            return string(node->value);
+        case NODE_UNARY:
+            return "-" + describeOperand(node->children[0]);
+        case NODE_BINOP:
+            return describeOperand(node->children[0]) + " " + operatorSymbol(node->op) + " " +
+                   describeOperand(node->children[1]);
+        case NODE_CALL: {
+            string text = string(node->value) + "(";
+            for (size_t i = 0; i < node->children.size(); i++) {
+                if (i > 0) text += ", ";
+                text += describe(node->children[i]);
+            }
+            return text + ")";
+        }
+        default:
+            return "?";
+        }
+    }
+
+    static string describeOperand(const ASTNode* node) {
+        if (node && (node->type == NODE_BINOP)) return "(" + describe(node) + ")";
+        return describe(node);
+    }
+};
+
+// Bytecode (OP_ADD..OP_GTE mirror OPR_ADD..OPR_GTE)
+enum OpCode : unsigned char {
+    OP_PUSH_NUM, OP_PUSH_STR, OP_LOAD, OP_STORE,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+    OP_EQ, OP_NEQ, OP_LT, OP_GT, OP_LTE, OP_GTE, OP_NEG,
+    OP_RANDOM, OP_SQRT, OP_POW, OP_ABS, OP_FLOOR, OP_CEIL,
+    OP_INPUT, OP_INPUT_NUM, OP_PRINT, OP_WRITE, OP_CLEAR,
+    OP_JUMP, OP_JUMP_IF_FALSE, OP_JUMP_IF_ZERO, OP_JUMP_IF_NOT_STRING, OP_APPEND,
+    OP_REPEAT_INIT, OP_REPEAT_TEST, OP_FOR_INIT, OP_FOR_TEST, OP_FOR_SET, OP_FOR_STEP,
+    OP_FOR_INIT_BY, OP_FOR_TEST_BY, OP_FOR_STEP_BY,
+    OP_GOTO_MISSING, OP_CALL, OP_RETURN, OP_POP,
+    OP_NEW_ARRAY, OP_MAKE_ARRAY, OP_LEN, OP_LOAD_INDEX, OP_LOAD_INDEX_UNCHECKED,
+    OP_STORE_INDEX, OP_STORE_INDEX_UNCHECKED, OP_PUSH_ITEM, OP_FILL,
+    OP_SUM, OP_MIN, OP_MAX, OP_DOT, OP_SCALE, OP_CLAMP,
+    OP_MAKE_DICT, OP_HAS, OP_KEYS, OP_REMOVE, OP_EACH_NEXT, OP_RANDOMS, OP_HALT
+};
+
+// Variable operands (OP_LOAD, OP_STORE, OP_APPEND, OP_JUMP_IF_NOT_STRING, the
+// array element and update ops, and the b of OP_FOR_SET) are global slots when >= 0; -1 - n is local n of the
+// running procedure. Register operands count from the running frame's first
+// register.
+struct Instr {
+    OpCode op;
+    int a;
+    int b;
+};
+
+// A procedure's code starts at entry and runs up to the next procedure's
+// entry (or the end); the main program comes first and ends with OP_HALT
+struct Procedure {
+    string name;
+    int entry = 0;
+    int params = 0;         // arguments arrive in locals 0..params-1
+    int numRegs = 0;        // loop counter registers per call
+    vector<string> locals;  // local slot -> name, for diagnostics
+};
+
+struct LabelAt {
+    string name;
+    int pc;
+    int line;
+};
+
+struct Bytecode {
+    vector<Instr> code;
+    vector<double> numbers;  // constant pool for OP_PUSH_NUM
+    vector<string> strings;  // constant pool for OP_PUSH_STR, prompts and goto targets
+    vector<string> names;    // slot -> variable name, for diagnostics
+    int numRegs = 0;         // loop counter registers of the main program
+    vector<Procedure> procs;
+    bool unchecked = false;  // compiled with --unchecked: array indexes are not bounds checked
+    vector<int> lines;       // source line of each instruction, 0 if none (for --profile)
+    vector<LabelAt> labels;  // every label and where it is, for --profile
+};
+
+// Compiler: lowers a parsed NODE_PROGRAM into flat bytecode
+class Compiler {
+    Bytecode out;
+    Resolver resolver{out.names};
+    map<string, int, less<>> stringIndex;
+    map<string, int, less<>> procIndex;
+    map<string, size_t, less<>> labels;  // label -> code address (the last definition wins)
+    vector<pair<size_t, string>> gotos;  // jump instruction -> label
+    vector<size_t> missingGotos;         // OP_GOTO_MISSING awaiting end of statement
+    int* regCount = nullptr;             // registers of the code being compiled
+    bool inProcedure = false;
+    int currentProc = -1;                // procedure being compiled, -1 for the main program
+    int line = 0;                        // source line of the statement being compiled
+    size_t haltAt = SIZE_MAX;            // --repl: the OP_HALT ending the entries so far
+    map<string, size_t, less<>> mainLabels;  // --repl: labels of the main program so far
+    size_t errors = 0;                   // problems reported so far
+    vector<ASTNode*> defines;            // --repl: procedure -> its NODE_DEFINE
+
+public:
+    // unchecked: index arrays without bounds checks (--unchecked)
+    Compiler(bool unchecked = false) { out.unchecked = unchecked; }
+
+    Bytecode compile(ASTNode* program) {
+        resolver.resolve(program);
+        auto bodies = defineProcedures(program);
+        compileBody(program->children, out.numRegs);
+        emit(OP_HALT);
+        compileProcedures(bodies);
+        return out;
+    }
+
+    // --repl: compiles one more entry onto the end of the program so far and
+    // returns where its code starts. The previous entry's OP_HALT becomes a
+    // jump to it, so the entries make up one program; variables, procedures
+    // and labels carry over. An entry with a problem is taken back out whole
+    // and SIZE_MAX returned, so the program only holds entries that compiled.
+    size_t compileMore(ASTNode* entry) {
+        size_t errorsBefore = errors, start = out.code.size(), numbers = out.numbers.size();
+        size_t strings = out.strings.size(), names = out.names.size(), procs = out.procs.size();
+        size_t labelsAt = out.labels.size();
+        int regs = out.numRegs;
+
+        resolver.resolve(entry);
+        auto bodies = defineProcedures(entry);
+        inProcedure = false;
+        currentProc = -1;
+        labels = mainLabels;
+        compileBody(entry->children, out.numRegs, false);
+        size_t halt = emit(OP_HALT);
+        compileProcedures(bodies);
+
+        if (errors > errorsBefore) {
+            out.code.resize(start);
+            out.lines.resize(start);
+            out.numbers.resize(numbers);
+            for (size_t i = strings; i < out.strings.size(); i++) stringIndex.erase(out.strings[i]);
+            out.strings.resize(strings);
+            resolver.forget(names);
+            out.names.resize(names);
+            for (size_t i = procs; i < out.procs.size(); i++) procIndex.erase(out.procs[i].name);
+            out.procs.resize(procs);
+            defines.resize(procs);
+            out.labels.resize(labelsAt);
+            out.numRegs = regs;
+            return SIZE_MAX;
+        }
+        if (haltAt != SIZE_MAX) out.code[haltAt] = {OP_JUMP, 0, (int)start};
+        haltAt = halt;
+        mainLabels = labels;
+        rebindProcedures(procs, names);
+        return start;
+    }
+
+    // The program compiled by compileMore so far
+    const Bytecode& program() const { return out; }
+
+private:
+    // Procedures are numbered up front so a call may come before its define;
+    // returns each one's number and body
+    vector<pair<int, ASTNode*>> defineProcedures(ASTNode* program) {
+        vector<pair<int, ASTNode*>> bodies;
+        for (auto& child : program->children) {
+            if (!child || child->type != NODE_DEFINE) continue;
+            Procedure proc;
+            proc.name = child->value;
+            proc.params = (int)child->children.size() - 1;
+            proc.locals = resolver.localsOf(child);
+            if (procIndex.count(child->value)) {
+                problem() << "Procedure " << child->value << " is already defined" << endl;
+                continue;
+            }
+            int index = (int)out.procs.size();
+            procIndex[proc.name] = index;
+            out.procs.push_back(proc);
+            defines.push_back(child);
+            bodies.push_back({index, child->children.back()});
+        }
+        return bodies;
+    }
+
+    // --repl: in a file, a name a procedure assigns is global if the main
+    // program uses it anywhere. An entry can use a name for the first time
+    // after a procedure took it as a local, so each such procedure is
+    // compiled again to use the global from now on (runRepl keeps the ASTs
+    // of the session alive for this).
+    void rebindProcedures(size_t procs, size_t firstNewSlot) {
+        for (size_t i = 0; i < procs; i++) {
+            Procedure& proc = out.procs[i];
+            string moved;
+            for (size_t slot = firstNewSlot; slot < out.names.size(); slot++) {
+                if (find(proc.locals.begin() + proc.params, proc.locals.end(), out.names[slot]) != proc.locals.end()) {
+                    moved += (moved.empty() ? "" : ", ") + out.names[slot];
+                }
+            }
+            if (moved.empty()) continue;
+            *diagnostics << proc.name << " now uses the global " << moved
+                         << "; calls made before this entry set a local of their own" << endl;
+            resolver.resolveAgain(defines[i]);
+            proc.locals = resolver.localsOf(defines[i]);
+            proc.numRegs = 0;
+            compileProcedures({{(int)i, defines[i]->children.back()}});
+        }
+    }
+
+    // Falling off the end of a procedure returns 0
+    void compileProcedures(const vector<pair<int, ASTNode*>>& bodies) {
+        inProcedure = true;
+        for (auto& body : bodies) {
+            currentProc = body.first;
+            out.procs[currentProc].entry = (int)out.code.size();
+            compileBody(body.second->children, out.procs[currentProc].numRegs);
+            emitNumber(0);
+            emit(OP_RETURN);
+        }
+    }
+
+    ostream& problem() {
+        errors++;
+        return *diagnostics;
+    }
+
+    size_t emit(OpCode op, int a = 0, int b = 0) {
+        out.code.push_back({op, a, b});
+        out.lines.push_back(line);
+        return out.code.size() - 1;
+    }
+
+    void patch(size_t at) { out.code[at].b = (int)out.code.size(); }
+
+    int stringConst(string_view s) {
+        auto it = stringIndex.find(s);
+        if (it != stringIndex.end()) return it->second;
+        out.strings.emplace_back(s);
+        return stringIndex[out.strings.back()] = (int)out.strings.size() - 1;
+    }
+
+    // The main program and each procedure body have their own labels;
+    // labels at any depth are goto targets, so they are all found up front
+    void compileBody(const NodeList& statements, int& regs, bool freshLabels = true) {
+        if (freshLabels) labels.clear();
+        gotos.clear();
+        regCount = &regs;
+        for (auto& child : statements) collectLabels(child);
+
+        for (auto& child : statements) {
+            if (child && child->type == NODE_DEFINE) continue;
+            compileStatement(child);
+            // A goto to an unknown label abandons the rest of its top-level statement
+            for (size_t at : missingGotos) out.code[at].b = (int)out.code.size();
+            missingGotos.clear();
+        }
+
+        for (auto& g : gotos) {
+            out.code[g.first].b = (int)labels[g.second];
+        }
+    }
+
+    void collectLabels(const ASTNode* node) {
+        if (!node || node->type == NODE_DEFINE) return;
+        if (node->type == NODE_LABEL) labels[string(node->value)] = 0;
+        for (auto& child : node->children) collectLabels(child);
+    }
+
+    // Every loop gets its own registers, so a goto into a loop body from
+    // outside resumes that loop's own counter rather than a sibling's
+    int allocRegs(int count) {
+        int reg = *regCount;
+        *regCount += count;
+        return reg;
+    }
+
+    // Two adjacent unnamed variables holding a loop each's collection and
+    // position; returns the operand of the first
+    int hiddenPair() {
+        vector<string>& names = currentProc < 0 ? out.names : out.procs[currentProc].locals;
+        int first = (int)names.size();
+        names.push_back("(each)");
+        names.push_back("(each)");
+        return currentProc < 0 ? first : -1 - first;
+    }
+
+    static int varOperand(const ASTNode* node) {
+        return node->local ? -1 - node->slot : node->slot;
+    }
+
+    // Code emitted for a statement is tagged with its line; the tail of a
+    // loop goes back to the loop's own line once the body is done
+    void compileStatement(ASTNode* node) {
+        if (!node) return;
+        int outer = line;
+        line = node->line;
+        compileStatementCode(node);
+        line = outer;
+    }
+
+    void compileStatementCode(ASTNode* node) {
+        switch (node->type) {
+        case NODE_LET:
+            if (auto operands = selfAppendOperands(node); !operands.empty()) {
+                // Append in place while the variable holds a string; otherwise
+                // fall back to the general load/add/store sequence
+                size_t slow = emit(OP_JUMP_IF_NOT_STRING, varOperand(node));
+                for (ASTNode* operand : operands) {
+                    compileExpr(operand);
+                    emit(OP_APPEND, varOperand(node));
+                }
+                size_t done = emit(OP_JUMP);
+                patch(slow);
+                compileExpr(node->children[0]);
+                emit(OP_STORE, varOperand(node));
+                patch(done);
+                break;
+            }
+            compileExpr(node->children[0]);
+            emit(OP_STORE, varOperand(node));
+            break;
+        case NODE_PRINT:
+            compileExpr(node->children[0]);
+            emit(OP_PRINT);
+            break;
+        case NODE_WRITE:
+            compileExpr(node->children[0]);
+            emit(OP_WRITE);
+            break;
+        case NODE_CLEAR:
+            emit(OP_CLEAR);
+            break;
+        case NODE_WHEN: {
+            compileExpr(node->children[0]);
+            size_t skipThen = emit(OP_JUMP_IF_FALSE);
+            compileStatement(node->children[1]);
+            if (node->children.size() > 2) {
+                size_t skipElse = emit(OP_JUMP);
+                patch(skipThen);
+                compileStatement(node->children[2]);
+                patch(skipElse);
+            } else {
+                patch(skipThen);
+            }
+            break;
+        }
+        case NODE_REPEAT: {
+            compileExpr(node->children[0]);
+            int reg = allocRegs(1);
+            emit(OP_REPEAT_INIT, reg);
+            size_t test = emit(OP_REPEAT_TEST, reg);
+            compileStatement(node->children[1]);
+            emit(OP_JUMP, 0, (int)test);
+            patch(test);
+            break;
+        }
+        case NODE_LOOP_WHILE: {
+            size_t top = out.code.size();
+            compileExpr(node->children[0]);
+            size_t exit = emit(OP_JUMP_IF_ZERO);
+            compileStatement(node->children[1]);
+            emit(OP_JUMP, 0, (int)top);
+            patch(exit);
+            break;
+        }
+        case NODE_LOOP_FOR: {
+            // The counter (then end and step) live in registers. The loop is
+            // entered only if the range is not empty, and after that one
+            // instruction steps, tests and jumps back to the top.
+            ASTNode* step = node->children.size() > 3 ? node->children[3] : nullptr;
+            bool byStep = step && !(step->type == NODE_NUMBER && step->number == 1);
+            compileExpr(node->children[0]);
+            compileExpr(node->children[1]);
+            if (byStep) compileExpr(step);
+            int reg = allocRegs(byStep ? 3 : 2);
+            emit(byStep ? OP_FOR_INIT_BY : OP_FOR_INIT, reg);
+            size_t test = emit(byStep ? OP_FOR_TEST_BY : OP_FOR_TEST, reg);
+            size_t top = emit(OP_FOR_SET, reg, varOperand(node));
+            compileStatement(node->children[2]);
+            emit(byStep ? OP_FOR_STEP_BY : OP_FOR_STEP, reg, (int)top);
+            patch(test);
+            break;
+        }
+        case NODE_LOOP_EACH: {
+            // The collection is copied into a hidden variable, so changing it
+            // inside the body does not disturb the iteration
+            int hidden = hiddenPair();
+            int position = hidden >= 0 ? hidden + 1 : hidden - 1;
+            compileExpr(node->children[0]);
+            emit(OP_STORE, hidden);
+            emitNumber(0);
+            emit(OP_STORE, position);
+            size_t next = emit(OP_EACH_NEXT, hidden);
+            emit(OP_STORE, varOperand(node));
+            compileStatement(node->children[1]);
+            emit(OP_JUMP, 0, (int)next);
+            patch(next);
+            break;
+        }
+        case NODE_GOTO:
+            if (labels.count(node->value)) {
+                gotos.push_back({emit(OP_JUMP), string(node->value)});
+            } else {
+                missingGotos.push_back(emit(OP_GOTO_MISSING, stringConst(node->value)));
+            }
+            break;
+        case NODE_LABEL:
+            labels[string(node->value)] = out.code.size();
+            out.labels.push_back({string(node->value), (int)out.code.size(), node->line});
+            break;
+        case NODE_BLOCK:
+            for (auto& child : node->children) compileStatement(child);
+            break;
+        case NODE_PROC_CALL:
+            compileExpr(node);
+            emit(OP_POP);
+            break;
+        case NODE_LET_INDEX:
+            compileExpr(node->children[0]);
+            compileExpr(node->children.size() > 1 ? node->children[1] : nullptr);
+            emit(out.unchecked ? OP_STORE_INDEX_UNCHECKED : OP_STORE_INDEX, varOperand(node));
+            break;
+        case NODE_PUSH:
+        case NODE_FILL:
+            compileExpr(node->children.empty() ? nullptr : node->children[0]);
+            emit(node->type == NODE_PUSH ? OP_PUSH_ITEM : OP_FILL, varOperand(node));
+            break;
+        case NODE_REMOVE:
+            compileExpr(node->children.empty() ? nullptr : node->children[0]);
+            emit(OP_REMOVE, varOperand(node));
+            break;
+        case NODE_RETURN:
+            if (!inProcedure) {
+                problem() << "return is only allowed inside a procedure" << endl;
+                break;
+            }
+            compileExpr(node->children.empty() ? nullptr : node->children[0]);
+            emit(OP_RETURN);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void compileExpr(ASTNode* node) {
+        if (!node) {
+            emitNumber(0);
+            return;
+        }
+
+        switch (node->type) {
+        case NODE_NUMBER:
+            emitNumber(node->number);
+            break;
+        case NODE_STRING:
+            emit(OP_PUSH_STR, stringConst(node->value));
+            break;
+        case NODE_IDENT:
+            emit(OP_LOAD, varOperand(node));
+            break;
+        case NODE_INPUT:
+        case NODE_INPUT_NUM: {
+            int prompt = -1;
+            if (node->children.size() > 0 && node->children[0]->type == NODE_STRING) {
+                prompt = stringConst(node->children[0]->value);
+            }
+            emit(node->type == NODE_INPUT ? OP_INPUT : OP_INPUT_NUM, prompt);
+            break;
+        }
+        case NODE_CALL: {
+            size_t arity = builtinArity(node->fn, node->children.size());
+            for (size_t i = 0; i < arity; i++) {
+                compileExpr(i < node->children.size() ? node->children[i] : nullptr);
+            }
+            switch (node->fn) {
+            case FN_RANDOM: emit(OP_RANDOM); break;
+            case FN_SQRT: emit(OP_SQRT); break;
+            case FN_POW: emit(OP_POW); break;
+            case FN_ABS: emit(OP_ABS); break;
+            case FN_FLOOR: emit(OP_FLOOR); break;
+            case FN_CEIL: emit(OP_CEIL); break;
+            case FN_ARRAY: emit(OP_NEW_ARRAY); break;
+            case FN_LEN: emit(OP_LEN); break;
+            case FN_SUM: emit(OP_SUM); break;
+            case FN_MIN: emit(OP_MIN, (int)arity); break;
+            case FN_MAX: emit(OP_MAX, (int)arity); break;
+            case FN_DOT: emit(OP_DOT); break;
+            case FN_SCALE: emit(OP_SCALE); break;
+            case FN_CLAMP: emit(OP_CLAMP); break;
+            case FN_HAS: emit(OP_HAS); break;
+            case FN_KEYS: emit(OP_KEYS); break;
+            case FN_RANDOMS: emit(OP_RANDOMS, (int)arity); break;
+            default: break;
+            }
+            break;
+        }
+        case NODE_ARRAY:
+            for (auto& child : node->children) compileExpr(child);
+            emit(OP_MAKE_ARRAY, (int)node->children.size());
+            break;
+        case NODE_DICT:
+            for (auto& child : node->children) compileExpr(child);
+            emit(OP_MAKE_DICT, (int)node->children.size() / 2);
+            break;
+        case NODE_INDEX:
+            compileExpr(node->children[0]);
+            emit(out.unchecked ? OP_LOAD_INDEX_UNCHECKED : OP_LOAD_INDEX, varOperand(node));
+            break;
+        case NODE_PROC_CALL: {
+            auto it = procIndex.find(node->value);
+            if (it == procIndex.end()) {
+                problem() << "Unknown procedure: " << node->value << endl;
+                emitNumber(0);
+                break;
+            }
+            // Missing arguments are 0 and extra ones are dropped, as for builtins
+            int params = out.procs[it->second].params;
+            if ((int)node->children.size() != params) {
+                problem() << "Procedure " << node->value << " expects " << params << " argument(s), got "
+                          << node->children.size() << endl;
+            }
+            for (int i = 0; i < params; i++) {
+                compileExpr(i < (int)node->children.size() ? node->children[i] : nullptr);
+            }
+            emit(OP_CALL, it->second);
+            break;
+        }
+        case NODE_UNARY:
+            compileExpr(node->children[0]);
+            emit(OP_NEG);
+            break;
+        case NODE_BINOP:
+            compileExpr(node->children[0]);
+            compileExpr(node->children[1]);
+            if (node->op != OPR_NONE) emit((OpCode)(OP_ADD + (node->op - OPR_ADD)));
+            break;
+        default:
+            emitNumber(0);
+            break;
+        }
+    }
+
+    void emitNumber(double n) {
+        out.numbers.push_back(n);
+        emit(OP_PUSH_NUM, (int)out.numbers.size() - 1);
+    }
+};
+
+// A program's text, mapped read-only so the lexer's tokens point straight
+// into the file. Pipes and other files that cannot be mapped are read into
+// memory instead.
+class SourceFile {
+    void* mapped = nullptr;
+    size_t size = 0;
+    string copy;
+
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    ~SourceFile() {
+        if (mapped) munmap(mapped, size);
+    }
+
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void* at = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (at != MAP_FAILED) {
+                mapped = at;
+                size = info.st_size;
+                madvise(mapped, size, MADV_SEQUENTIAL);
+                close(fd);
+                return true;
+            }
+        }
+        char buffer[65536];
+        ssize_t got;
+        while ((got = read(fd, buffer, sizeof(buffer))) > 0) copy.append(buffer, got);
+        close(fd);
+        return got == 0;
+    }
+
+    string_view text() const { return mapped ? string_view((const char*)mapped, size) : string_view(copy); }
+};
+
+// Lexes, parses and compiles source, reporting problems to errors. The
+// result is never changed by running it, so one compiled program can be
+// shared by any number of Interpreters, on any threads.
+shared_ptr<const Bytecode> compileProgram(string_view source, ostream& errors = cerr, bool optimize = false,
+                                          bool foldReport = false, bool unchecked = false) {
+    ostream* outer = diagnostics;
+    diagnostics = &errors;
+    Lexer lexer(source);
     vector<Token> tokens = lexer.tokenize();
+    AstArena arena;
+    Parser parser(tokens, arena);
+    auto ast = parser.parse();
+    if (optimize) {
+        Optimizer optimizer(arena, foldReport);
+        optimizer.optimize(ast);
+    }
+    auto bc = make_shared<const Bytecode>(Compiler(unchecked).compile(ast));
+    diagnostics = outer;
+    return bc;
+}
+
+// Bytecode images (.flowc): a compiled program saved by `flow --compile` and
+// loaded without lexing or parsing. The layout is native-endian and tied to
+// IMAGE_VERSION; any mismatch is rejected and the source must be recompiled.
+const char IMAGE_MAGIC[8] = {'F', 'L', 'O', 'W', 'B', 'C', '\r', '\n'};
+const uint32_t IMAGE_VERSION = 8;
+const uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+
+struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t instrSize;
+    uint32_t numRegs;
+    uint32_t codeCount;
+    uint32_t numberCount;
+    uint32_t stringCount;
+    uint32_t nameCount;
+    uint32_t procCount;
+    uint32_t labelCount;
+    uint32_t flags;
+};
+
+const uint32_t IMAGE_UNCHECKED = 1;
+
+bool saveImage(const Bytecode& bc, const string& path) {
+    ofstream file(path, ios::binary);
+    if (!file) return false;
+
+    ImageHeader header;
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byteOrder = IMAGE_BYTE_ORDER;
+    header.instrSize = sizeof(Instr);
+    header.numRegs = bc.numRegs;
+    header.codeCount = bc.code.size();
+    header.numberCount = bc.numbers.size();
+    header.stringCount = bc.strings.size();
+    header.nameCount = bc.names.size();
+    header.procCount = bc.procs.size();
+    header.labelCount = bc.labels.size();
+    header.flags = bc.unchecked ? IMAGE_UNCHECKED : 0;
+    file.write((const char*)&header, sizeof(header));
+
+    for (const Instr& in : bc.code) {
+        Instr clean;
+        memset(&clean, 0, sizeof(clean)); // keep padding bytes deterministic
+        clean.op = in.op;
+        clean.a = in.a;
+        clean.b = in.b;
+        file.write((const char*)&clean, sizeof(clean));
+    }
+    file.write((const char*)bc.numbers.data(), bc.numbers.size() * sizeof(double));
+    auto writeString = [&](const string& s) {
+        uint32_t length = s.size();
+        file.write((const char*)&length, sizeof(length));
+        file.write(s.data(), s.size());
+    };
+    for (const string& s : bc.strings) writeString(s);
+    for (const string& s : bc.names) writeString(s);
+    for (const Procedure& proc : bc.procs) {
+        uint32_t fields[4] = {(uint32_t)proc.entry, (uint32_t)proc.params, (uint32_t)proc.numRegs,
+                              (uint32_t)proc.locals.size()};
+        writeString(proc.name);
+        file.write((const char*)fields, sizeof(fields));
+        for (const string& s : proc.locals) writeString(s);
+    }
+    file.write((const char*)bc.lines.data(), bc.lines.size() * sizeof(int));
+    for (const LabelAt& label : bc.labels) {
+        int32_t fields[2] = {label.pc, label.line};
+        writeString(label.name);
+        file.write((const char*)fields, sizeof(fields));
+    }
+    return (bool)file;
+}
+
+// Reads sections out of a mapped image, refusing to run past its end
+class ImageReader {
+    const char* pos;
+    const char* end;
+
+public:
+    ImageReader(const char* data, size_t size) : pos(data), end(data + size) {}
+
+    bool read(void* out, size_t bytes) {
+        if ((size_t)(end - pos) < bytes) return false;
+        memcpy(out, pos, bytes);
+        pos += bytes;
+        return true;
+    }
+
+    bool readString(string& out) {
+        uint32_t length;
+        if (!read(&length, sizeof(length)) || (size_t)(end - pos) < length) return false;
+        out.assign(pos, length);
+        pos += length;
+        return true;
+    }
+};
+
+// Every path must reach each instruction with the same operand stack depth,
+// no instruction may pop more than is there, and a procedure must return
+// exactly one value. Control flow stays within [start, end).
+bool validStackDepths(const Bytecode& bc, size_t start, size_t end) {
+    vector<int> depth(end - start, -1);
+    vector<size_t> work = {start};
+    depth[0] = 0;
+    while (!work.empty()) {
+        size_t pc = work.back();
+        work.pop_back();
+        const Instr& in = bc.code[pc];
+
+        int needs = 0, change = 0;
+        switch (in.op) {
+        case OP_PUSH_NUM: case OP_PUSH_STR: case OP_LOAD: case OP_INPUT: case OP_INPUT_NUM:
+            change = 1;
+            break;
+        case OP_STORE: case OP_PRINT: case OP_WRITE: case OP_APPEND: case OP_POP:
+        case OP_JUMP_IF_FALSE: case OP_JUMP_IF_ZERO: case OP_REPEAT_INIT: case OP_PUSH_ITEM: case OP_FILL:
+            needs = 1, change = -1;
+            break;
+        case OP_NEG: case OP_SQRT: case OP_ABS: case OP_FLOOR: case OP_CEIL:
+        case OP_NEW_ARRAY: case OP_LEN: case OP_LOAD_INDEX: case OP_LOAD_INDEX_UNCHECKED: case OP_SUM:
+            needs = 1;
+            break;
+        case OP_DOT: case OP_SCALE:
+            needs = 2, change = -1;
+            break;
+        case OP_CLAMP:
+            needs = 3, change = -2;
+            break;
+        case OP_HAS: case OP_REMOVE:
+            needs = 2 - (in.op == OP_REMOVE), change = -1;
+            break;
+        case OP_KEYS:
+            needs = 1;
+            break;
+        case OP_MAKE_DICT:
+            needs = 2 * in.a, change = 1 - 2 * in.a;
+            break;
+        case OP_EACH_NEXT:
+            change = 1; // only when it falls through to the loop body
+            break;
+        case OP_MIN: case OP_MAX: case OP_RANDOMS:
+            needs = in.a, change = 1 - in.a;
+            break;
+        case OP_FOR_INIT: case OP_STORE_INDEX: case OP_STORE_INDEX_UNCHECKED:
+            needs = 2, change = -2;
+            break;
+        case OP_FOR_INIT_BY:
+            needs = 3, change = -3;
+            break;
+        case OP_MAKE_ARRAY:
+            needs = in.a, change = 1 - in.a;
+            break;
+        case OP_CALL:
+            needs = bc.procs[in.a].params, change = 1 - needs;
+            break;
+        case OP_RETURN:
+            if (depth[pc - start] != 1) return false;
+            break;
+        default:
+            if (in.op >= OP_ADD && in.op <= OP_GTE) needs = 2, change = -1;
+            if (in.op == OP_RANDOM || in.op == OP_POW) needs = 2, change = -1;
+            break;
+        }
+        if (depth[pc - start] < needs) return false;
+        int after = depth[pc - start] + change;
+
+        vector<pair<size_t, int>> next; // successor and its depth
+        bool jumps = in.op == OP_JUMP || in.op == OP_JUMP_IF_FALSE || in.op == OP_JUMP_IF_ZERO ||
+                     in.op == OP_JUMP_IF_NOT_STRING || in.op == OP_REPEAT_TEST || in.op == OP_FOR_TEST ||
+                     in.op == OP_FOR_STEP || in.op == OP_FOR_TEST_BY || in.op == OP_FOR_STEP_BY ||
+                     in.op == OP_GOTO_MISSING || in.op == OP_EACH_NEXT;
+        if (jumps) next.push_back({(size_t)in.b, in.op == OP_EACH_NEXT ? depth[pc - start] : after});
+        if (in.op != OP_JUMP && in.op != OP_GOTO_MISSING && in.op != OP_HALT && in.op != OP_RETURN) {
+            if (pc + 1 >= end) return false;
+            next.push_back({pc + 1, after});
+        }
+        for (auto& [target, at] : next) {
+            if (target < start || target >= end) return false;
+            if (depth[target - start] == -1) {
+                depth[target - start] = at;
+                work.push_back(target);
+            } else if (depth[target - start] != at) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Operand checks so a damaged image cannot make the VM index out of range.
+// Code from start to end belongs to proc (nullptr for the main program).
+bool validCode(const Bytecode& bc, const Procedure* proc, size_t start, size_t end) {
+    size_t regs = proc ? proc->numRegs : bc.numRegs;
+    size_t locals = proc ? proc->locals.size() : 0;
+    if (regs > 2 * (end - start)) return false; // a loop takes at most 3 registers and several instructions
+    auto validVar = [&](int operand) {
+        return operand >= 0 ? (size_t)operand < bc.names.size() : (size_t)(-1 - (long)operand) < locals;
+    };
+    for (size_t pc = start; pc < end; pc++) {
+        const Instr& in = bc.code[pc];
+        if (in.op > OP_HALT) return false;
+        size_t a = (size_t)in.a, b = (size_t)in.b;
+        bool target = b >= start && b < end;
+        switch (in.op) {
+        case OP_PUSH_NUM:
+            if (a >= bc.numbers.size()) return false;
+            break;
+        case OP_PUSH_STR:
+            if (a >= bc.strings.size()) return false;
+            break;
+        case OP_INPUT: case OP_INPUT_NUM:
+            if (in.a != -1 && a >= bc.strings.size()) return false;
+            break;
+        case OP_LOAD: case OP_STORE: case OP_APPEND: case OP_LOAD_INDEX: case OP_STORE_INDEX:
+        case OP_PUSH_ITEM: case OP_FILL: case OP_REMOVE:
+            if (!validVar(in.a)) return false;
+            break;
+        case OP_EACH_NEXT:
+            if (!validVar(in.a) || !validVar(in.a >= 0 ? in.a + 1 : in.a - 1) || !target) return false;
+            break;
+        case OP_LOAD_INDEX_UNCHECKED: case OP_STORE_INDEX_UNCHECKED:
+            if (!bc.unchecked || !validVar(in.a)) return false;
+            break;
+        case OP_MAKE_ARRAY:
+            if (in.a < 0) return false;
+            break;
+        case OP_MAKE_DICT:
+            if (in.a < 0 || a > end - start) return false; // also keeps 2 * a from overflowing
+            break;
+        case OP_MIN: case OP_MAX:
+            if (in.a != 1 && in.a != 2) return false;
+            break;
+        case OP_RANDOMS:
+            if (in.a != 1 && in.a != 3) return false;
+            break;
+        case OP_JUMP_IF_NOT_STRING:
+            if (!validVar(in.a) || !target) return false;
+            break;
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_JUMP_IF_ZERO:
+            if (!target) return false;
+            break;
+        case OP_GOTO_MISSING:
+            if (a >= bc.strings.size() || !target) return false;
+            break;
+        case OP_REPEAT_INIT:
+            if (a >= regs) return false;
+            break;
+        case OP_REPEAT_TEST:
+            if (a >= regs || !target) return false;
+            break;
+        case OP_FOR_INIT:
+            if (a + 1 >= regs) return false;
+            break;
+        case OP_FOR_TEST: case OP_FOR_STEP:
+            if (a + 1 >= regs || !target) return false;
+            break;
+        case OP_FOR_SET:
+            if (a + 1 >= regs || !validVar(in.b)) return false;
+            break;
+        case OP_FOR_INIT_BY:
+            if (a + 2 >= regs) return false;
+            break;
+        case OP_FOR_TEST_BY: case OP_FOR_STEP_BY:
+            if (a + 2 >= regs || !target) return false;
+            break;
+        case OP_CALL:
+            if (a >= bc.procs.size()) return false;
+            break;
+        case OP_RETURN:
+            if (!proc) return false;
+            break;
+        default:
+            break;
+        }
+    }
+    return validStackDepths(bc, start, end);
+}
+
+bool validImage(const Bytecode& bc) {
+    // Procedures follow the main program in entry order
+    size_t mainEnd = bc.procs.empty() ? bc.code.size() : (size_t)bc.procs[0].entry;
+    if (mainEnd == 0 || mainEnd > bc.code.size() || bc.code[mainEnd - 1].op != OP_HALT) return false;
+    for (const Procedure& proc : bc.procs) {
+        if (proc.params < 0 || (size_t)proc.params > proc.locals.size() || proc.numRegs < 0) return false;
+    }
+    if (!validCode(bc, nullptr, 0, mainEnd)) return false;
+    for (size_t i = 0; i < bc.procs.size(); i++) {
+        size_t start = bc.procs[i].entry;
+        size_t end = i + 1 < bc.procs.size() ? (size_t)bc.procs[i + 1].entry : bc.code.size();
+        if (start >= end || end > bc.code.size() || !validCode(bc, &bc.procs[i], start, end)) return false;
+    }
+    return true;
+}
+
+// Maps a .flowc file and rebuilds the Bytecode it holds
+bool loadImage(const string& path, Bytecode& bc, string& error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "Could not open file: " + path;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(ImageHeader)) {
+        close(fd);
+        error = "Not a Flow bytecode image: " + path;
+        return false;
+    }
+    size_t size = info.st_size;
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        error = "Could not map file: " + path;
+        return false;
+    }
+
+    ImageReader reader((const char*)mapped, size);
+    ImageHeader header;
+    bool ok = reader.read(&header, sizeof(header)) && memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0;
+    if (ok && (header.version != IMAGE_VERSION || header.byteOrder != IMAGE_BYTE_ORDER ||
+               header.instrSize != sizeof(Instr))) {
+        munmap(mapped, size);
+        error = "Bytecode image was built by a different version of flow, recompile: " + path;
+        return false;
+    }
+
+    if (ok) {
+        bc.numRegs = header.numRegs;
+        bc.unchecked = (header.flags & IMAGE_UNCHECKED) != 0;
+        ok = header.codeCount <= size / sizeof(Instr) && header.numberCount <= size / sizeof(double) &&
+             header.stringCount <= size && header.nameCount <= size && header.procCount <= size &&
+             header.labelCount <= size;
+    }
+    if (ok) {
+        bc.code.resize(header.codeCount);
+        bc.numbers.resize(header.numberCount);
+        bc.strings.resize(header.stringCount);
+        bc.names.resize(header.nameCount);
+        ok = reader.read(bc.code.data(), bc.code.size() * sizeof(Instr)) &&
+             reader.read(bc.numbers.data(), bc.numbers.size() * sizeof(double));
+        for (size_t i = 0; ok && i < bc.strings.size(); i++) ok = reader.readString(bc.strings[i]);
+        for (size_t i = 0; ok && i < bc.names.size(); i++) ok = reader.readString(bc.names[i]);
+        for (uint32_t i = 0; ok && i < header.procCount; i++) {
+            Procedure proc;
+            uint32_t fields[4];
+            ok = reader.readString(proc.name) && reader.read(fields, sizeof(fields)) && fields[3] <= size;
+            if (!ok) break;
+            proc.entry = (int)fields[0];
+            proc.params = (int)fields[1];
+            proc.numRegs = (int)fields[2];
+            proc.locals.resize(fields[3]);
+            for (size_t j = 0; ok && j < proc.locals.size(); j++) ok = reader.readString(proc.locals[j]);
+            bc.procs.push_back(std::move(proc));
+        }
+        bc.lines.resize(bc.code.size());
+        ok = ok && reader.read(bc.lines.data(), bc.lines.size() * sizeof(int));
+        for (uint32_t i = 0; ok && i < header.labelCount; i++) {
+            LabelAt label;
+            int32_t fields[2];
+            ok = reader.readString(label.name) && reader.read(fields, sizeof(fields)) && fields[0] >= 0 &&
+                 (size_t)fields[0] < bc.code.size();
+            label.pc = fields[0];
+            label.line = fields[1];
+            bc.labels.push_back(std::move(label));
+        }
+    }
+    munmap(mapped, size);
+
+    if (!ok || !validImage(bc)) {
+        error = "Corrupt bytecode image: " + path;
+        return false;
+    }
+    return true;
+}
+
+// Output: collects program output in a large buffer and writes it to stdout
+// in big chunks. It is flushed before input is read, on clear and at exit;
+// when stdout is a terminal (or with --unbuffered) every print and write
+// goes out immediately, as an interactive program expects.
+//
+// In screen mode (--screen) everything printed after a clear is composed
+// into an in-memory frame instead. At the next clear, before input and at
+// exit the frame is compared with what the terminal already shows and only
+// the changed parts of changed lines are rewritten using cursor movement.
+class Output {
+    static const size_t CAPACITY = 1 << 16;
+    static constexpr const char* CLEAR_SCREEN = "\033[2J\033[H";
+    vector<char> buffer;
+    size_t used;
+    bool immediate;
+    ostream* sink = &cout;
+
+    // Screen mode
+    bool screenMode;
+    bool composing;      // a clear has been seen; output goes to frame
+    string frame;        // text printed since the last clear
+    vector<string> shown; // lines the terminal currently displays
+    bool shownValid;     // false after a frame too tall for the terminal
+    size_t screenRows;
+    size_t cursorRow, cursorCol;
+
+    // --screen-stats
+    bool stats;
+    size_t frames;
+    size_t plainBytes;   // what the same output costs without screen mode
+    size_t bytesWritten;
+
+public:
+    Output()
+        : buffer(CAPACITY), used(0), immediate(isatty(STDOUT_FILENO)),
+          screenMode(false), composing(false), shownValid(false), screenRows(0), cursorRow(0), cursorCol(0),
+          stats(false), frames(0), plainBytes(0), bytesWritten(0) {}
+
+    ~Output() {
+        flush();
+        if (stats) {
+            *diagnostics << "[screen] frames: " << frames << ", bytes written: " << bytesWritten
+                 << ", without --screen: " << plainBytes;
+            if (frames > 0) *diagnostics << ", per frame: " << bytesWritten / frames << " vs " << plainBytes / frames;
+            *diagnostics << endl;
+        }
+    }
+
+    void setUnbuffered(bool unbuffered) { immediate = unbuffered || (sink == &cout && isatty(STDOUT_FILENO)); }
+
+    // Send output to s instead of stdout; it is then never treated as a terminal
+    void setSink(ostream* s) {
+        flush();
+        sink = s;
+        immediate = false;
+        screenRows = SIZE_MAX;
+    }
+
+    void setScreenMode(bool enabled, bool withStats) {
+        screenMode = enabled || withStats;
+        stats = withStats;
+        // Off a terminal there is no scrolling to worry about
+        screenRows = SIZE_MAX;
+        winsize size;
+        if (isatty(STDOUT_FILENO) && ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0) {
+            screenRows = size.ws_row;
+        }
+    }
+
+    void write(string_view s) {
+        plainBytes += s.size();
+        if (composing) frame.append(s);
+        else emit(s);
+    }
+
+    // Same text as `cout << n` (%g with 6 significant digits)
+    void writeNumber(double n) {
+        char text[32];
+        auto result = to_chars(text, text + sizeof(text), n, chars_format::general, 6);
+        write(string_view(text, result.ptr - text));
+    }
+
+    void writeValue(const Value& v) {
+        if (v.isString()) write(v.text());
+        else if (v.isArray()) writeArray(v.items());
+        else if (v.isDict()) writeDict(v.dict());
+        else writeNumber(v.number());
+    }
+
+    // [1, 2, "three"]
+    void writeArray(const ArrayRep& items) {
+        write("[");
+        for (size_t i = 0; i < items.size(); i++) {
+            if (i > 0) write(", ");
+            if (!items.mixed) writeNumber(items.numbers[i]);
+            else writeElement(items.values[i]);
+        }
+        write("]");
+    }
+
+    // {"a": 1, 2: "two"}
+    void writeDict(const DictRep& dict) {
+        write("{");
+        bool first = true;
+        for (auto& entry : dict.entries) {
+            if (entry.removed) continue;
+            if (!first) write(", ");
+            first = false;
+            writeElement(entry.key);
+            write(": ");
+            writeElement(entry.value);
+        }
+        write("}");
+    }
+
+    // A number, or a string in quotes
+    void writeElement(const Value& v) {
+        if (v.isString()) {
+            write("\"");
+            write(v.text());
+            write("\"");
+        } else {
+            writeNumber(v.number());
+        }
+    }
+
+    // End of a print or write statement
+    void endStatement() {
+        if (immediate && !composing) flush();
+    }
+
+    void clear() {
+        plainBytes += strlen(CLEAR_SCREEN);
+        if (!screenMode) {
+            emit(CLEAR_SCREEN);
+        } else if (!composing) {
+            emit(CLEAR_SCREEN);
+            composing = true;
+            shown.assign(1, string());
+            shownValid = true;
+            cursorRow = cursorCol = 0;
+        } else {
+            // The finished frame stays on screen until the next one is drawn over it
+            render();
+            frames++;
+            frame.clear();
+        }
+        flushBuffer();
+    }
+
+    // The terminal echoes what the user types; keep the frame in step with it
+    void echoInput(const string& line) {
+        if (!composing || !isatty(STDIN_FILENO)) return;
+        frame.append(line).append("\n");
+        if (shownValid) {
+            shown = splitLines(frame);
+            cursorRow = shown.size() - 1;
+            cursorCol = 0;
+        }
+    }
+
+    void flush() {
+        if (composing) render();
+        flushBuffer();
+    }
+
+private:
+    void flushBuffer() {
+        if (used > 0) {
+            sink->write(buffer.data(), used);
+            used = 0;
+        }
+        sink->flush();
+    }
+
+    void emit(string_view s) {
+        bytesWritten += s.size();
+        if (used + s.size() > CAPACITY) {
+            if (used > 0) sink->write(buffer.data(), used);
+            used = 0;
+            if (s.size() > CAPACITY) {
+                sink->write(s.data(), s.size());
+                return;
+            }
+        }
+        memcpy(buffer.data() + used, s.data(), s.size());
+        used += s.size();
+    }
+
+    static vector<string> splitLines(const string& text) {
+        vector<string> lines(1);
+        for (char c : text) {
+            if (c == '\n') lines.emplace_back();
+            else lines.back() += c;
+        }
+        return lines;
+    }
+
+    // Terminal columns taken by the first `bytes` bytes of a UTF-8 line
+    static size_t columns(const string& line, size_t bytes) {
+        size_t cols = 0;
+        for (size_t i = 0; i < bytes; i++) {
+            if (((unsigned char)line[i] & 0xC0) != 0x80) cols++;
+        }
+        return cols;
+    }
+
+    void moveTo(string& cmd, size_t row, size_t col) {
+        if (row == cursorRow && col == cursorCol) return;
+        if (row == cursorRow + 1 && col == 0) cmd += "\r\n";
+        else cmd += "\033[" + to_string(row + 1) + ";" + to_string(col + 1) + "H";
+        cursorRow = row;
+        cursorCol = col;
+    }
+
+    void render() {
+        vector<string> next = splitLines(frame);
+        string cmd;
+
+        if (!shownValid || next.size() >= screenRows || shown.size() >= screenRows) {
+            // The terminal would scroll, so cursor positions are unreliable
+            cmd = CLEAR_SCREEN + frame;
+            shownValid = next.size() < screenRows;
+            cursorRow = next.size() - 1;
+            cursorCol = columns(next.back(), next.back().size());
+        } else {
+            for (size_t row = 0; row < max(next.size(), shown.size()); row++) {
+                const string& now = row < next.size() ? next[row] : string();
+                const string& before = row < shown.size() ? shown[row] : string();
+                if (now == before) continue;
+
+                size_t same = 0;
+                while (same < now.size() && same < before.size() && now[same] == before[same]) same++;
+                while (same > 0 && ((unsigned char)now[same] & 0xC0) == 0x80) same--;
+
+                moveTo(cmd, row, columns(now, same));
+                cmd.append(now, same, string::npos);
+                cursorCol = columns(now, now.size());
+                if (columns(before, before.size()) > cursorCol) cmd += "\033[K";
+            }
+            moveTo(cmd, next.size() - 1, columns(next.back(), next.back().size()));
+        }
+
+        shown = std::move(next);
+        emit(cmd);
+    }
+};
+
+// xoshiro256** (Blackman and Vigna): fast, with 256 bits of state. Each
+// Interpreter has its own, so nothing is shared with other code in the
+// process.
+class Random {
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    // Uniform in [0, n) for n > 0 without modulo bias (Lemire): the high
+    // half of next() * n, redrawn in the rare case the low half shows the
+    // draw fell in the uneven part of the range
+    uint64_t below(uint64_t n, uint64_t threshold) {
+        unsigned __int128 m = (unsigned __int128)next() * n;
+        while ((uint64_t)m < threshold) m = (unsigned __int128)next() * n;
+        return (uint64_t)(m >> 64);
+    }
+
+    // Integral range bounds, kept where doubles are exact
+    static int64_t bound(double x) {
+        if (!(x > -9e15)) return x != x ? 0 : -9e15;
+        return x < 9e15 ? (int64_t)x : 9e15;
+    }
+
+public:
+    explicit Random(uint64_t seed = 0) { reseed(seed); }
+
+    // splitmix64 spreads the seed over the state, so seeds that differ by
+    // one still give unrelated sequences
+    void reseed(uint64_t seed) {
+        for (uint64_t& word : state) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    // Whole number from lo to hi inclusive (either way round)
+    double between(double lo, double hi) {
+        double n;
+        fillBetween(&n, 1, lo, hi);
+        return n;
+    }
+
+    // count whole numbers from lo to hi; the range is worked out once
+    void fillBetween(double* out, size_t count, double lo, double hi) {
+        int64_t low = bound(lo), high = bound(hi);
+        if (high < low) swap(low, high);
+        uint64_t span = (uint64_t)(high - low) + 1;
+        uint64_t threshold = -span % span;
+        for (size_t i = 0; i < count; i++) out[i] = (double)(low + (int64_t)below(span, threshold));
+    }
+
+    // count numbers in [0, 1), using the top 53 bits of each draw
+    void fillUnit(double* out, size_t count) {
+        for (size_t i = 0; i < count; i++) out[i] = (next() >> 11) * 0x1.0p-53;
+    }
+};
+
+// --profile: how often each instruction ran, plus call stacks sampled about
+// every INTERVAL_US of CPU time. The timer only fires on a kernel tick, so
+// each sample is weighted by the CPU time measured since the one before.
+struct Profile {
+    static constexpr int INTERVAL_US = 1000;
+    static constexpr size_t MAX_STACK = 256;  // deeper samples keep only the innermost calls
+
+    struct Sample {
+        double time;           // wall-clock seconds since the program started
+        double cpu;            // CPU seconds since the previous sample
+        vector<uint32_t> pcs;  // the CALL of each active frame, outermost first, then the current pc
+        bool truncated;
+    };
+    vector<uint64_t> counts;
+    vector<Sample> samples;
+};
+
+// The timer is per process, so only one interpreter at a time can profile
+volatile sig_atomic_t profileTick = 0;
+
+// Set by Ctrl-C in the REPL; stops the entry that is running
+volatile sig_atomic_t interruptRequested = 0;
+
+void onInterrupt(int) { interruptRequested = 1; }
+
+void onProfileTimer(int) { profileTick = 1; }
+
+// ITIMER_PROF only counts CPU time, so waiting for input is not sampled
+void setProfileTimer(bool on) {
+    if (on) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = onProfileTimer;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGPROF, &action, nullptr);
+    }
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    if (on) timer.it_interval.tv_usec = timer.it_value.tv_usec = Profile::INTERVAL_US;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+// --record / --replay session logs: the random seed, then each line of
+// input in the order the program read it
+//     seed 1712345678
+//     > 100
+//     > buy
+const char* const SESSION_SEED = "seed ";
+const char* const SESSION_INPUT = "> ";
+
+// Stops a program that runs too long or holds too much (--max-steps,
+// --max-time, --max-memory); 0 means no limit
+struct Limits {
+    uint64_t steps = 0;    // instructions executed
+    double seconds = 0;    // wall-clock time, including waiting for input
+    size_t bytes = 0;      // strings, arrays, dictionaries and variables
+};
+
+// Exit status of a program stopped by one of its Limits
+const int EXIT_LIMIT = 3;
+
+// A procedure call in progress: where the caller resumes and its frame
+struct Frame {
+    size_t returnPc;
+    size_t base;      // caller's first local
+    size_t regBase;   // caller's first register
+    int proc;         // caller, -1 for the main program
+};
+
+// Interpreter
+class Interpreter {
+    // Globals by slot, followed by the locals of every active call. Frames
+    // are consecutive windows, so a call only moves base forward; the vectors
+    // grow when a call goes deeper than any before it and are then reused.
+    vector<Value> variables;
+    vector<unsigned char> assigned;  // variable has been given a value
+    vector<double> regs;             // loop counters, also per frame
+    vector<Frame> frames;
+    size_t maxDepth;
+    bool unchecked;
+    Profile* profile = nullptr;
+    Limits limits;
+    bool interruptible = false;
+    bool limited = false;
+    bool limitHit = false;
+    uint64_t steps = 0;        // instructions run before the current countdown
+    uint64_t checkSpan = 0;    // length of the current countdown
+    uint64_t untilCheck = 0;   // instructions left before limits are checked again
+    chrono::steady_clock::time_point started;
+    size_t startPc = 0;
+    bool keepVariables = false;
+    size_t liveGlobals = 0;  // globals holding values from earlier runs (--repl)
+    vector<Value> stringPool;  // bc.strings as Values
+    double sampledCpu = 0;  // CPU seconds at the last sample
+    uint64_t seed;
+    Random rng;
+    istream* input = &cin;
+    string inputEnd;  // reported once when input runs out
+    ostream* record = nullptr;
+    ostream* errors = &cerr;
+    Output out;
+
+public:
+    static constexpr size_t DEFAULT_MAX_DEPTH = 10000;
+    static constexpr double MAX_ARRAY_SIZE = 100000000;
+
+    Interpreter(bool unbuffered = false, bool screen = false, bool screenStats = false)
+        : maxDepth(DEFAULT_MAX_DEPTH), unchecked(false),
+          seed(time(0) ^ chrono::steady_clock::now().time_since_epoch().count() ^ (uintptr_t)this), rng(seed) {
+        out.setUnbuffered(unbuffered);
+        out.setScreenMode(screen, screenStats);
+    }
+
+    // Calls nested deeper than this stop the program (--max-depth)
+    void setMaxDepth(size_t depth) { maxDepth = depth; }
+
+    // Skip array bounds checks (--unchecked); an index out of range is then
+    // undefined behaviour, so only use it for programs known to be correct
+    void setUnchecked(bool skip) { unchecked = skip; }
+
+    // Count and sample the next run into p (--profile)
+    void setProfile(Profile* p) { profile = p; }
+
+    void setLimits(const Limits& l) {
+        limits = l;
+        limited = l.steps || l.seconds > 0 || l.bytes || interruptible;
+    }
+
+    // Let interruptRequested stop a run (the REPL's Ctrl-C)
+    void setInterruptible(bool on) {
+        interruptible = on;
+        setLimits(limits);
+    }
+
+    // The last run was stopped by a limit rather than finishing or an error
+    bool stoppedByLimit() const { return limitHit; }
+
+    // random() starts from the clock unless given a seed (--seed, --replay)
+    void setSeed(uint64_t s) {
+        seed = s;
+        rng.reseed(seed);
+    }
+    uint64_t getSeed() const { return seed; }
+
+    // Read input lines from in instead of the terminal (--replay, --batch);
+    // reading past its end reports endMessage
+    void setInput(istream* in, const string& endMessage = "The replayed session has no more input") {
+        input = in;
+        inputEnd = endMessage;
+    }
+
+    // Log every input line to log as it is read (--record)
+    void setRecord(ostream* log) { record = log; }
+
+    // Send print and write output to o instead of stdout
+    void setOutput(ostream* o) { out.setSink(o); }
+
+    // Send runtime errors and limit messages to e instead of stderr
+    void setErrors(ostream* e) { errors = e; }
+
+    bool run(ASTNode* program) {
+        return run(Compiler(unchecked).compile(program));
+    }
+
+    // Bytecode VM; returns false if the program was stopped by an error
+    // or a limit. The program's values are freed before it returns, so the
+    // Interpreter may then be reused or destroyed on any thread.
+    bool run(const Bytecode& bc) { return runFrom(bc, 0, false); }
+
+    // Runs bc from start with the variables left by the previous run (--repl).
+    // bc must be the previous run's program with more code added. The values
+    // kept between runs were counted on the running thread, so an Interpreter
+    // used this way must be resumed and destroyed on that thread.
+    bool resume(const Bytecode& bc, size_t start) { return runFrom(bc, start, true); }
+
+private:
+    bool runFrom(const Bytecode& bc, size_t start, bool keep) {
+        startPc = start;
+        keepVariables = keep;
+        if (interruptible) interruptRequested = 0;
+        started = chrono::steady_clock::now();
+        limitHit = false;
+        steps = 0;
+        checkSpan = untilCheck = nextCheckSpan();
+        if (profile) {
+            profile->counts.assign(bc.code.size(), 0);
+            profile->samples.clear();
+            sampledCpu = cpuSeconds();
+            profileTick = 0;
+            setProfileTimer(true);
+        }
+
+        ostream* outerDiagnostics = diagnostics;
+        diagnostics = errors;
+        // Memory over the limit throws bad_alloc from wherever it was allocated
+        size_t outerLimit = heapLimit;
+        if (limits.bytes) heapLimit = heapBytes + limits.bytes;
+        bool ok;
+        try {
+            if (profile) ok = limited ? execute<true, true>(bc) : execute<true, false>(bc);
+            else ok = limited ? execute<false, true>(bc) : execute<false, false>(bc);
+        } catch (const bad_alloc&) {
+            if (limits.bytes) stopForLimit("Memory limit of " + to_string(limits.bytes / 1048576) + " MB exceeded");
+            else *diagnostics << "Out of memory" << endl;
+            out.flush();
+            ok = false;
+        }
+        heapLimit = outerLimit;
+        diagnostics = outerDiagnostics;
+
+        // The memory a run's values hold was counted on this thread, so it is
+        // given back here rather than wherever the Interpreter ends up being
+        // reused or destroyed. resume() keeps it for the next entry.
+        if (!keep) {
+            variables.clear();
+            assigned.clear();
+            stringPool.clear();
+            liveGlobals = 0;
+        }
+
+        if (profile) setProfileTimer(false);
+        return ok;
+    }
+
+    static constexpr uint64_t CHECK_EVERY = 4096;  // instructions between limit checks
+
+    void stopForLimit(const string& why) {
+        *diagnostics << why << "; program stopped" << endl;
+        limitHit = true;
+    }
+
+    // Instructions until the next check: CHECK_EVERY, or fewer so that one
+    // lands on the first instruction past the step limit
+    uint64_t nextCheckSpan() const {
+        if (!limits.steps) return CHECK_EVERY;
+        uint64_t allowed = limits.steps - steps;
+        return allowed < CHECK_EVERY ? allowed + 1 : CHECK_EVERY;
+    }
+
+    // Runs before every CHECK_EVERY-th instruction (and before the one past
+    // the step limit), so the clock is read rarely; false stops the program
+    // without running that instruction
+    bool withinLimits() {
+        steps += checkSpan;
+        if (interruptible && interruptRequested) {
+            interruptRequested = 0;
+            stopForLimit("Interrupted");
+            return false;
+        }
+        if (limits.steps && steps > limits.steps) {
+            stopForLimit("Step limit of " + to_string(limits.steps) + " instructions reached");
+            return false;
+        }
+        if (limits.seconds > 0 &&
+            chrono::duration<double>(chrono::steady_clock::now() - started).count() > limits.seconds) {
+            ostringstream why;
+            why << "Time limit of " << limits.seconds << " seconds reached";
+            stopForLimit(why.str());
+            return false;
+        }
+        // Variables (and locals of calls in progress) count too; what they
+        // point to is already in heapBytes
+        if (limits.bytes && heapBytes + variables.size() * sizeof(Value) > heapLimit) {
+            stopForLimit("Memory limit of " + to_string(limits.bytes / 1048576) + " MB exceeded");
+            return false;
+        }
+        checkSpan = untilCheck = nextCheckSpan();
+        return true;
+    }
+
+    // The VM loop. The profiling build counts every instruction and takes a
+    // sample when the timer has fired; the limited build counts down to the
+    // next limit check. The plain build does neither.
+    template <bool PROFILE, bool LIMITED>
+    bool execute(const Bytecode& bc) {
+        size_t globals = bc.names.size();
+        // Everything past the kept globals may be stale locals of earlier calls
+        size_t kept = keepVariables ? min(liveGlobals, globals) : 0;
+        variables.resize(max(variables.size(), globals + 64));
+        assigned.resize(variables.size());
+        fill(variables.begin() + kept, variables.end(), Value());
+        fill(assigned.begin() + kept, assigned.end(), 0);
+        liveGlobals = globals;
+        if (keepVariables) regs.resize(max(regs.size(), (size_t)bc.numRegs + 64));
+        else regs.assign(bc.numRegs + 64, 0);
+        frames.clear();
+        frames.reserve(min(maxDepth, (size_t)1024));
+        vector<Value> stack;
+        stack.reserve(64);
+        // String constants are built once so OP_PUSH_STR only bumps a refcount;
+        // a resumed program (--repl) only adds the ones its new code brought
+        if (!keepVariables || stringPool.size() > bc.strings.size()) stringPool.clear();
+        stringPool.insert(stringPool.end(), bc.strings.begin() + stringPool.size(), bc.strings.end());
+        const Value* strings = stringPool.data();
+        const Instr* code = bc.code.data();
+        size_t pc = startPc;
+
+        // The running frame
+        int proc = -1;
+        size_t base = globals;
+        size_t regBase = 0;
+        auto slot = [&](int operand) -> size_t {
+            return operand >= 0 ? (size_t)operand : base - 1 - operand;
+        };
+        auto nameOf = [&](int operand) -> const string& {
+            return operand >= 0 ? bc.names[operand] : bc.procs[proc].locals[-1 - operand];
+        };
+        // The array in a variable, or nullptr after reporting why there is none
+        auto arrayIn = [&](int operand, const char* use) -> Value* {
+            size_t at = slot(operand);
+            if (assigned[at] && variables[at].isArray()) return &variables[at];
+            if (!assigned[at]) *diagnostics << "Undefined variable: " << nameOf(operand) << endl;
+            else *diagnostics << "Cannot " << use << " " << nameOf(operand) << ": it is not an array" << endl;
+            return nullptr;
+        };
+
+        // The dictionary held by a variable, or nullptr if it holds something else
+        auto dictIn = [&](int operand) -> Value* {
+            size_t at = slot(operand);
+            return assigned[at] && variables[at].isDict() ? &variables[at] : nullptr;
+        };
+
+        for (;;) {
+            if constexpr (PROFILE) {
+                profile->counts[pc]++;
+                if (profileTick) takeSample(pc);
+            }
+            if constexpr (LIMITED) {
+                if (--untilCheck == 0 && !withinLimits()) {
+                    out.flush();
+                    return false;
+                }
+            }
+            const Instr& in = code[pc++];
+            switch (in.op) {
+            case OP_PUSH_NUM:
+                stack.push_back(Value(bc.numbers[in.a]));
+                break;
+            case OP_PUSH_STR:
+                stack.push_back(strings[in.a]);
+                break;
+            case OP_LOAD: {
+                size_t at = slot(in.a);
+                if (assigned[at]) {
+                    stack.push_back(variables[at]);
+                } else {
+                    *diagnostics << "Undefined variable: " << nameOf(in.a) << endl;
+                    stack.push_back(Value(0.0));
+                }
+                break;
+            }
+            case OP_STORE: {
+                size_t at = slot(in.a);
+                variables[at] = std::move(stack.back());
+                assigned[at] = 1;
+                stack.pop_back();
+                break;
+            }
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+            case OP_EQ: case OP_NEQ: case OP_LT: case OP_GT: case OP_LTE: case OP_GTE: {
+                Value& left = stack[stack.size() - 2];
+                Value& right = stack.back();
+                if (left.isNumber() && right.isNumber()) {
+                    double l = left.number(), r = right.number(), result = 0;
+                    switch (in.op) {
+                    case OP_ADD: result = l + r; break;
+                    case OP_SUB: result = l - r; break;
+                    case OP_MUL: result = l * r; break;
+                    case OP_DIV: result = l / r; break;
+                    case OP_MOD: result = (double)((int)l % (int)r); break;
+                    case OP_EQ: result = l == r ? 1.0 : 0.0; break;
+                    case OP_NEQ: result = l != r ? 1.0 : 0.0; break;
+                    case OP_LT: result = l < r ? 1.0 : 0.0; break;
+                    case OP_GT: result = l > r ? 1.0 : 0.0; break;
+                    case OP_LTE: result = l <= r ? 1.0 : 0.0; break;
+                    default: result = l >= r ? 1.0 : 0.0; break;
+                    }
+                    stack.pop_back();
+                    left.setNumber(result);
+                } else if (left.isArray() || right.isArray()) {
+                    // Element-wise, in place when left is a temporary
+                    if (!arrayArithmetic((Operator)(OPR_ADD + (in.op - OP_ADD)), left, right)) left = Value(0.0);
+                    stack.pop_back();
+                } else {
+                    Value result = binaryOp((Operator)(OPR_ADD + (in.op - OP_ADD)), left, right);
+                    stack.pop_back();
+                    stack.back() = result;
+                }
+                break;
+            }
+            case OP_NEG:
+                if (!stack.back().isNumber()) {
+                    *diagnostics << "Unary operator requires a number, not " << stack.back().kindName() << endl;
+                    stack.back() = Value(0.0);
+                } else {
+                    stack.back().setNumber(-stack.back().number());
+                }
+                break;
+            case OP_RANDOM: {
+                double max = stack.back().number();
+                stack.pop_back();
+                stack.back() = Value(rng.between(stack.back().number(), max));
+                break;
+            }
+            case OP_RANDOMS: {
+                // randoms(n): n numbers in [0, 1); randoms(n, lo, hi): n whole numbers
+                size_t first = stack.size() - in.a;
+                Value& size = stack[first];
+                double n = size.number();
+                if (!size.isNumber() || !(n >= 0 && n <= MAX_ARRAY_SIZE)) {
+                    *diagnostics << "randoms() needs a count from 0 to " << MAX_ARRAY_SIZE << endl;
+                    n = 0;
+                }
+                ArrayRep* array = new ArrayRep((size_t)n);
+                if (in.a == 1) {
+                    rng.fillUnit(array->numbers.data(), array->numbers.size());
+                } else {
+                    rng.fillBetween(array->numbers.data(), array->numbers.size(), stack[first + 1].number(),
+                                    stack[first + 2].number());
+                }
+                stack.erase(stack.begin() + first + 1, stack.end());
+                size = Value(array);
+                break;
+            }
+            case OP_POW: {
+                Value exp = stack.back();
+                stack.pop_back();
+                Value& base = stack.back();
+                if (!base.isNumber() || !exp.isNumber()) {
+                    *diagnostics << "pow() requires numbers, not " << (base.isArray() || exp.isArray() ? "arrays" : "strings")
+                         << endl;
+                    base = Value(0.0);
+                } else {
+                    base.setNumber(pow(base.number(), exp.number()));
+                }
+                break;
+            }
+            case OP_SQRT: case OP_ABS: case OP_FLOOR: case OP_CEIL: {
+                Value& val = stack.back();
+                if (!val.isNumber()) {
+                    static const char* names[] = {"sqrt", "pow", "abs", "floor", "ceil"};
+                    *diagnostics << names[in.op - OP_SQRT] << "() requires a number, not " << val.kindName() << endl;
+                    val = Value(0.0);
+                } else if (in.op == OP_SQRT) {
+                    val.setNumber(sqrt(val.number()));
+                } else if (in.op == OP_ABS) {
+                    val.setNumber(fabs(val.number()));
+                } else if (in.op == OP_FLOOR) {
+                    val.setNumber(floor(val.number()));
+                } else {
+                    val.setNumber(ceil(val.number()));
+                }
+                break;
+            }
+            case OP_INPUT: case OP_INPUT_NUM: {
+                string input = readLine(in.a >= 0 ? string_view(bc.strings[in.a]) : string_view());
+                if (in.op == OP_INPUT) {
+                    stack.push_back(Value(input));
+                    break;
+                }
+                try {
+                    stack.push_back(Value(stod(input)));
+                } catch (...) {
+                    *diagnostics << "Invalid input - please enter a number" << endl;
+                    stack.push_back(Value(0.0));
+                }
+                break;
+            }
+            case OP_PRINT: case OP_WRITE:
+                out.writeValue(stack.back());
+                if (in.op == OP_PRINT) out.write("\n");
+                out.endStatement();
+                stack.pop_back();
+                break;
+            case OP_CLEAR:
+                out.clear();
+                break;
+            case OP_JUMP:
+                pc = in.b;
+                break;
+            case OP_JUMP_IF_FALSE: {
+                Value& cond = stack.back();
+                double condNum = cond.isString() ? (cond.text().empty() ? 0 : 1) : cond.number();
+                stack.pop_back();
+                if (condNum == 0) pc = in.b;
+                break;
+            }
+            case OP_JUMP_IF_NOT_STRING: {
+                size_t at = slot(in.a);
+                if (!assigned[at] || !variables[at].isString()) pc = in.b;
+                break;
+            }
+            case OP_APPEND:
+                appendTo(variables[slot(in.a)], stack.back());
+                stack.pop_back();
+                break;
+            case OP_JUMP_IF_ZERO: {
+                bool zero = stack.back().number() == 0;
+                stack.pop_back();
+                if (zero) pc = in.b;
+                break;
+            }
+            case OP_REPEAT_INIT:
+                regs[regBase + in.a] = (int)stack.back().number();
+                stack.pop_back();
+                break;
+            case OP_REPEAT_TEST: {
+                double& count = regs[regBase + in.a];
+                if (count <= 0) pc = in.b;
+                else count--;
+                break;
+            }
+            case OP_FOR_INIT:
+                regs[regBase + in.a + 1] = stack.back().number();
+                stack.pop_back();
+                regs[regBase + in.a] = stack.back().number();
+                stack.pop_back();
+                break;
+            case OP_FOR_TEST:
+                if (!(regs[regBase + in.a] <= regs[regBase + in.a + 1])) pc = in.b;
+                break;
+            case OP_FOR_SET: {
+                size_t at = slot(in.b);
+                variables[at].setNumber(regs[regBase + in.a]);
+                assigned[at] = 1;
+                break;
+            }
+            case OP_FOR_STEP:
+                if (++regs[regBase + in.a] <= regs[regBase + in.a + 1]) pc = in.b;
+                break;
+            case OP_FOR_INIT_BY: {
+                double step = stack.back().number();
+                stack.pop_back();
+                regs[regBase + in.a + 2] = step;
+                regs[regBase + in.a + 1] = stack.back().number();
+                stack.pop_back();
+                regs[regBase + in.a] = stack.back().number();
+                stack.pop_back();
+                if (step == 0) {
+                    // NaN fails every test, so the loop is skipped
+                    *diagnostics << "Loop step cannot be 0" << endl;
+                    regs[regBase + in.a] = NAN;
+                }
+                break;
+            }
+            case OP_FOR_TEST_BY: {
+                const double* r = &regs[regBase + in.a]; // counter, end, step
+                if (!(r[2] > 0 ? r[0] <= r[1] : r[0] >= r[1])) pc = in.b;
+                break;
+            }
+            case OP_FOR_STEP_BY: {
+                double* r = &regs[regBase + in.a];
+                r[0] += r[2];
+                if (r[2] > 0 ? r[0] <= r[1] : r[0] >= r[1]) pc = in.b;
+                break;
+            }
+            case OP_GOTO_MISSING:
+                *diagnostics << "Label not found: " << bc.strings[in.a] << endl;
+                pc = in.b;
+                break;
+            case OP_CALL: {
+                const Procedure& callee = bc.procs[in.a];
+                if (frames.size() >= maxDepth) {
+                    *diagnostics << "Recursion limit of " << maxDepth << " calls exceeded in " << callee.name << endl;
+                    out.flush();
+                    return false;
+                }
+                size_t newBase = base + (proc < 0 ? 0 : bc.procs[proc].locals.size());
+                size_t newRegBase = regBase + (proc < 0 ? bc.numRegs : bc.procs[proc].numRegs);
+                size_t needed = newBase + callee.locals.size();
+                if (needed > variables.size()) {
+                    variables.resize(max(needed, variables.size() * 2));
+                    assigned.resize(variables.size(), 0);
+                }
+                if (newRegBase + callee.numRegs > regs.size()) {
+                    regs.resize(max(newRegBase + callee.numRegs, regs.size() * 2));
+                }
+                // Arguments move from the operand stack into the first locals
+                size_t args = stack.size() - callee.params;
+                for (int i = 0; i < callee.params; i++) {
+                    variables[newBase + i] = std::move(stack[args + i]);
+                    assigned[newBase + i] = 1;
+                }
+                stack.erase(stack.begin() + args, stack.end());
+                frames.push_back({pc, base, regBase, proc});
+                proc = in.a;
+                base = newBase;
+                regBase = newRegBase;
+                pc = callee.entry;
+                break;
+            }
+            case OP_RETURN: {
+                // The return value stays on top of the stack for the caller;
+                // locals are reset so the next call starts from scratch
+                size_t locals = bc.procs[proc].locals.size();
+                for (size_t i = 0; i < locals; i++) {
+                    variables[base + i].setNumber(0);
+                    assigned[base + i] = 0;
+                }
+                const Frame& frame = frames.back();
+                pc = frame.returnPc;
+                base = frame.base;
+                regBase = frame.regBase;
+                proc = frame.proc;
+                frames.pop_back();
+                break;
+            }
+            case OP_POP:
+                stack.pop_back();
+                break;
+            case OP_NEW_ARRAY: {
+                Value& size = stack.back();
+                double n = size.number();
+                if (!size.isNumber() || !(n >= 0 && n <= MAX_ARRAY_SIZE)) {
+                    *diagnostics << "array() needs a size from 0 to " << MAX_ARRAY_SIZE << endl;
+                    n = 0;
+                }
+                size = Value(new ArrayRep((size_t)n));
+                break;
+            }
+            case OP_MAKE_ARRAY: {
+                ArrayRep* array = new ArrayRep();
+                size_t first = stack.size() - in.a;
+                for (size_t i = first; i < stack.size(); i++) {
+                    if (stack[i].isArray() || stack[i].isDict()) {
+                        *diagnostics << "Arrays cannot contain arrays or dictionaries" << endl;
+                        array->push(Value(0.0));
+                    } else {
+                        array->push(stack[i]);
+                    }
+                }
+                stack.erase(stack.begin() + first, stack.end());
+                stack.push_back(Value(array));
+                break;
+            }
+            case OP_LEN: {
+                Value& val = stack.back();
+                if (val.isArray()) val = Value((double)val.items().size());
+                else if (val.isDict()) val = Value((double)val.dict().count);
+                else if (val.isString()) val = Value((double)val.text().size());
+                else {
+                    *diagnostics << "len() requires an array, a dictionary or a string" << endl;
+                    val.setNumber(0);
+                }
+                break;
+            }
+            case OP_LOAD_INDEX: {
+                Value& index = stack.back();
+                if (Value* dict = dictIn(in.a)) {
+                    lookup(dict->dict(), index, nameOf(in.a));
+                    break;
+                }
+                Value* array = arrayIn(in.a, "index");
+                if (!array) {
+                    index = Value(0.0);
+                    break;
+                }
+                const ArrayRep& items = array->items();
+                double i = index.number();
+                if (!index.isNumber() || !(i >= 0 && i < items.size())) {
+                    reportIndex(index, nameOf(in.a), items.size());
+                    index = Value(0.0);
+                } else if (items.mixed) {
+                    index = items.values[(size_t)i];
+                } else {
+                    index.setNumber(items.numbers[(size_t)i]);
+                }
+                break;
+            }
+            case OP_LOAD_INDEX_UNCHECKED: {
+                Value& index = stack.back();
+                if (Value* dict = dictIn(in.a)) {
+                    lookup(dict->dict(), index, nameOf(in.a));
+                    break;
+                }
+                Value* array = arrayIn(in.a, "index");
+                if (!array) index = Value(0.0);
+                else if (array->items().mixed) index = array->items().values[(size_t)index.number()];
+                else index.setNumber(array->items().numbers[(size_t)index.number()]);
+                break;
+            }
+            case OP_STORE_INDEX: case OP_STORE_INDEX_UNCHECKED: {
+                Value& index = stack[stack.size() - 2];
+                Value& value = stack.back();
+                Value* dict = dictIn(in.a);
+                Value* array = dict ? nullptr : arrayIn(in.a, "index");
+                double i = index.number();
+                if (dict) {
+                    if (value.isArray() || value.isDict()) {
+                        *diagnostics << "Dictionaries cannot contain arrays or dictionaries" << endl;
+                    } else if (validKey(index)) {
+                        dict->mutableDict().set(index, value);
+                    }
+                } else if (!array) {
+                    // reported by arrayIn
+                } else if (value.isArray() || value.isDict()) {
+                    *diagnostics << "Arrays cannot contain arrays or dictionaries" << endl;
+                } else if (in.op == OP_STORE_INDEX && (!index.isNumber() || !(i >= 0 && i < array->items().size()))) {
+                    reportIndex(index, nameOf(in.a), array->items().size());
+                } else {
+                    array->mutableItems().set((size_t)i, value);
+                }
+                stack.pop_back();
+                stack.pop_back();
+                break;
+            }
+            case OP_SUM: {
+                Value& val = stack.back();
+                const ArrayRep* items = numericArray(val, "sum");
+                val = Value(items ? arrayKernels->sum(items->numbers.data(), items->size()) : 0.0);
+                break;
+            }
+            case OP_MIN: case OP_MAX: {
+                const char* name = in.op == OP_MIN ? "min" : "max";
+                if (in.a == 2) {
+                    Value second = std::move(stack.back());
+                    stack.pop_back();
+                    Value& first = stack.back();
+                    if (!first.isNumber() || !second.isNumber()) {
+                        *diagnostics << name << "() of two values requires numbers" << endl;
+                        first = Value(0.0);
+                    } else if (in.op == OP_MIN ? second.number() < first.number() : second.number() > first.number()) {
+                        first = second;
+                    }
+                    break;
+                }
+                Value& val = stack.back();
+                const ArrayRep* items = numericArray(val, name);
+                if (items && items->size() == 0) {
+                    *diagnostics << name << "() of an empty array" << endl;
+                    items = nullptr;
+                }
+                double result = 0;
+                if (items) {
+                    auto kernel = in.op == OP_MIN ? arrayKernels->min : arrayKernels->max;
+                    result = kernel(items->numbers.data(), items->size());
+                }
+                val = Value(result);
+                break;
+            }
+            case OP_DOT: {
+                Value right = std::move(stack.back());
+                stack.pop_back();
+                Value& left = stack.back();
+                const ArrayRep* x = numericArray(left, "dot");
+                const ArrayRep* y = x ? numericArray(right, "dot") : nullptr;
+                if (x && y && x->size() != y->size()) {
+                    *diagnostics << "dot() requires arrays of the same length (" << x->size() << " and " << y->size() << ")"
+                         << endl;
+                    y = nullptr;
+                }
+                left = Value(x && y ? arrayKernels->dot(x->numbers.data(), y->numbers.data(), x->size()) : 0.0);
+                break;
+            }
+            case OP_SCALE: {
+                Value factor = std::move(stack.back());
+                stack.pop_back();
+                Value& val = stack.back();
+                if (!numericArray(val, "scale")) {
+                    val = Value(0.0);
+                } else if (!factor.isNumber()) {
+                    *diagnostics << "scale() requires a number to scale by" << endl;
+                    val = Value(0.0);
+                } else {
+                    arrayArithmetic(OPR_MUL, val, factor);
+                }
+                break;
+            }
+            case OP_CLAMP: {
+                double hi = stack.back().number();
+                bool numbers = stack.back().isNumber();
+                stack.pop_back();
+                double lo = stack.back().number();
+                numbers = numbers && stack.back().isNumber();
+                stack.pop_back();
+                Value& val = stack.back();
+                if (!numbers) {
+                    *diagnostics << "clamp() requires numbers for its limits" << endl;
+                    val = Value(0.0);
+                } else if (val.isNumber()) {
+                    double v = val.number() < lo ? lo : val.number();
+                    val.setNumber(v > hi ? hi : v);
+                } else if (const ArrayRep* items = numericArray(val, "clamp")) {
+                    size_t n = items->size();
+                    if (items->refs == 1) {
+                        double* data = val.mutableItems().numbers.data();
+                        arrayKernels->clamp(data, data, lo, hi, n);
+                    } else {
+                        ArrayRep* result = new ArrayRep(n);
+                        arrayKernels->clamp(result->numbers.data(), items->numbers.data(), lo, hi, n);
+                        val = Value(result);
+                    }
+                } else {
+                    val = Value(0.0);
+                }
+                break;
+            }
+            case OP_PUSH_ITEM: case OP_FILL: {
+                Value* array = arrayIn(in.a, in.op == OP_PUSH_ITEM ? "push to" : "fill");
+                if (!array) {
+                    // reported by arrayIn
+                } else if (stack.back().isArray() || stack.back().isDict()) {
+                    *diagnostics << "Arrays cannot contain arrays or dictionaries" << endl;
+                } else if (in.op == OP_PUSH_ITEM) {
+                    array->mutableItems().push(stack.back());
+                } else {
+                    array->mutableItems().fill(stack.back());
+                }
+                stack.pop_back();
+                break;
+            }
+            case OP_MAKE_DICT: {
+                DictRep* dict = new DictRep();
+                size_t first = stack.size() - 2 * (size_t)in.a;
+                for (size_t i = first; i < stack.size(); i += 2) {
+                    if (stack[i + 1].isArray() || stack[i + 1].isDict()) {
+                        *diagnostics << "Dictionaries cannot contain arrays or dictionaries" << endl;
+                    } else if (validKey(stack[i])) {
+                        dict->set(stack[i], stack[i + 1]);
+                    }
+                }
+                stack.erase(stack.begin() + first, stack.end());
+                stack.push_back(Value(dict));
+                break;
+            }
+            case OP_HAS: {
+                Value& key = stack.back();
+                Value& dict = stack[stack.size() - 2];
+                bool found = false;
+                if (!dict.isDict()) *diagnostics << "has() requires a dictionary" << endl;
+                else if (validKey(key)) found = dict.dict().find(key) >= 0;
+                stack.pop_back();
+                stack.back() = Value(found ? 1.0 : 0.0);
+                break;
+            }
+            case OP_KEYS: {
+                // An array of the keys in the order they were added
+                Value& val = stack.back();
+                ArrayRep* keys = new ArrayRep();
+                if (val.isDict()) {
+                    for (auto& entry : val.dict().entries) {
+                        if (!entry.removed) keys->push(entry.key);
+                    }
+                } else {
+                    *diagnostics << "keys() requires a dictionary" << endl;
+                }
+                val = Value(keys);
+                break;
+            }
+            case OP_REMOVE: {
+                size_t at = slot(in.a);
+                if (!assigned[at]) {
+                    *diagnostics << "Undefined variable: " << nameOf(in.a) << endl;
+                } else if (!variables[at].isDict()) {
+                    *diagnostics << "Cannot remove from " << nameOf(in.a) << ": it is not a dictionary" << endl;
+                } else if (validKey(stack.back()) && variables[at].dict().find(stack.back()) >= 0) {
+                    variables[at].mutableDict().remove(stack.back());
+                }
+                stack.pop_back();
+                break;
+            }
+            case OP_EACH_NEXT: {
+                // slot(a) holds the collection and the next variable its position;
+                // pushes the next key or element, or leaves the loop
+                Value& collection = variables[slot(in.a)];
+                Value& position = variables[slot(in.a) + 1];
+                double at = position.number();
+                size_t i = at > 0 ? (size_t)at : 0;
+                if (at < 0) {
+                    // finished earlier; reached again by a goto into the body
+                } else if (collection.isDict()) {
+                    const auto& entries = collection.dict().entries;
+                    while (i < entries.size() && entries[i].removed) i++;
+                    if (i < entries.size()) {
+                        stack.push_back(entries[i].key);
+                        position.setNumber((double)(i + 1));
+                        break;
+                    }
+                } else if (collection.isArray()) {
+                    const ArrayRep& items = collection.items();
+                    if (i < items.size()) {
+                        if (items.mixed) stack.push_back(items.values[i]);
+                        else stack.push_back(Value(items.numbers[i]));
+                        position.setNumber((double)(i + 1));
+                        break;
+                    }
+                } else {
+                    *diagnostics << "loop each requires an array or a dictionary, not "
+                         << (collection.isNumber() ? "a number" : collection.kindName()) << endl;
+                }
+                // Done: let go of the collection so it is not kept alive
+                collection.setNumber(0);
+                position.setNumber(-1);
+                pc = in.b;
+                break;
+            }
+            case OP_HALT:
+                out.flush();
+                return true;
+            }
+        }
+    }
 
-    // Parse
-    Parser parser(tokens);
-    auto ast = parser.parse();
+    static double cpuSeconds() {
+        timespec now;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+        return now.tv_sec + now.tv_nsec / 1e9;
+    }
 
-    // Execute
-    Interpreter interpreter;
-    interpreter.run(ast);
+    void takeSample(size_t pc) {
+        profileTick = 0;
+        Profile::Sample sample;
+        sample.time = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        double cpu = cpuSeconds();
+        sample.cpu = cpu - sampledCpu;
+        sampledCpu = cpu;
+        size_t first = frames.size() >= Profile::MAX_STACK ? frames.size() - Profile::MAX_STACK + 1 : 0;
+        sample.truncated = first > 0;
+        for (size_t i = first; i < frames.size(); i++) sample.pcs.push_back(frames[i].returnPc - 1);
+        sample.pcs.push_back(pc);
+        profile->samples.push_back(std::move(sample));
+    }
+
+    // Replaces key with its value in dict, or with 0 after reporting a missing key
+    static void lookup(const DictRep& dict, Value& key, const string& name) {
+        long at = validKey(key) ? dict.find(key) : -1;
+        if (at >= 0) {
+            key = dict.entries[at].value;
+            return;
+        }
+        if (key.isNumber() || key.isString()) {
+            *diagnostics << "Key not found in " << name << ": ";
+            if (key.isString()) *diagnostics << "\"" << key.text() << "\"" << endl;
+            else *diagnostics << key.number() << endl;
+        }
+        key = Value(0.0);
+    }
+
+    static bool validKey(const Value& key) {
+        if (key.isNumber() || key.isString()) return true;
+        *diagnostics << "Dictionary keys must be numbers or strings, not " << key.kindName() << endl;
+        return false;
+    }
+
+    // The numbers of an array argument, or nullptr after reporting why not
+    static const ArrayRep* numericArray(const Value& v, const char* fn) {
+        if (v.isArray() && !v.items().mixed) return &v.items();
+        *diagnostics << fn << "() requires an array of numbers" << endl;
+        return nullptr;
+    }
+
+    static void reportIndex(const Value& index, const string& name, size_t size) {
+        if (!index.isNumber()) {
+            *diagnostics << "Array index for " << name << " must be a number, not " << index.kindName() << endl;
+        } else {
+            *diagnostics << "Index " << index.number() << " is out of range for " << name << " (length " << size << ")"
+                 << endl;
+        }
+    }
+
+    // Shows the prompt (flushing everything printed so far) and reads one line
+    string readLine(string_view prompt) {
+        out.write(prompt);
+        out.flush();
+        string line;
+        bool read = (bool)getline(*input, line);
+        if (!read && input != &cin && !input->bad()) {
+            *diagnostics << inputEnd << endl;
+            input->clear(ios::badbit); // say so only once
+        }
+        // Only lines really typed are logged; past the end of input there is
+        // nothing to replay, and a replay runs out of input at the same point
+        if (record && read) *record << SESSION_INPUT << line << endl;
+        out.echoInput(line);
+        return line;
+    }
+
+};
+
+// Reads a session log; input gets the recorded lines, one per line
+bool loadSession(const string& path, uint64_t& seed, string& input, string& error) {
+    ifstream file(path);
+    if (!file) {
+        error = "Could not open file: " + path;
+        return false;
+    }
+    bool seeded = false;
+    string line;
+    for (int number = 1; getline(file, line); number++) {
+        if (line.compare(0, strlen(SESSION_INPUT), SESSION_INPUT) == 0) {
+            input.append(line, strlen(SESSION_INPUT), string::npos).append("\n");
+        } else if (line.compare(0, strlen(SESSION_SEED), SESSION_SEED) == 0) {
+            seed = strtoull(line.c_str() + strlen(SESSION_SEED), nullptr, 10);
+            seeded = true;
+        } else if (!line.empty() && line[0] != '#') {
+            error = path + " line " + to_string(number) + ": not a session log line";
+            return false;
+        }
+    }
+    if (!seeded) {
+        error = path + ": no seed line, not a session log";
+        return false;
+    }
+    return true;
+}
+
+// Turns a Profile into the --profile table, folded stacks for flamegraph
+// tools, or a Chrome trace (chrome://tracing, Perfetto)
+class ProfileReport {
+    const Bytecode& bc;
+    const Profile& profile;
+    vector<string> source;  // program text by line, empty for a .flowc
+
+    struct LineStats {
+        uint64_t runs = 0;   // most executions of any instruction on the line
+        double self = 0;     // CPU seconds sampled on the line
+        double total = 0;    // CPU seconds on it or in procedures it called
+    };
+
+public:
+    ProfileReport(const Bytecode& code, const Profile& p, string_view text) : bc(code), profile(p) {
+        while (!text.empty()) {
+            size_t end = min(text.find('\n'), text.size());
+            source.emplace_back(text.substr(0, end));
+            text.remove_prefix(min(end + 1, text.size()));
+        }
+    }
+
+    void writeTable(ostream& os) {
+        double ms = 1000;  // per second
+        double cpu = 0;
+        for (auto& sample : profile.samples) cpu += sample.cpu;
+        // The caller's number format comes back once the table is written
+        ios::fmtflags flags = os.flags();
+        streamsize precision = os.precision();
+        os << fixed << setprecision(1);
+        os << "Profile: " << profile.samples.size() << " samples over " << cpu * ms << " ms of CPU" << endl;
+
+        // Lines, hottest first
+        map<int, LineStats> lines;
+        for (size_t pc = 0; pc < bc.code.size(); pc++) {
+            if (!bc.lines[pc]) continue;
+            LineStats& stats = lines[bc.lines[pc]];
+            stats.runs = max(stats.runs, profile.counts[pc]);
+        }
+        for (auto& sample : profile.samples) {
+            vector<int> seen;
+            for (uint32_t pc : sample.pcs) {
+                int line = bc.lines[pc];
+                if (!line || find(seen.begin(), seen.end(), line) != seen.end()) continue;
+                seen.push_back(line);
+                lines[line].total += sample.cpu;
+            }
+            if (int line = bc.lines[sample.pcs.back()]) lines[line].self += sample.cpu;
+        }
+        vector<pair<int, LineStats>> hot(lines.begin(), lines.end());
+        stable_sort(hot.begin(), hot.end(), [](auto& x, auto& y) {
+            return x.second.total != y.second.total ? x.second.total > y.second.total : x.second.runs > y.second.runs;
+        });
+        os << endl << "  line         runs    self ms   total ms  code" << endl;
+        for (size_t i = 0; i < hot.size() && i < 20; i++) {
+            if (!hot[i].second.runs) break;
+            os << setw(6) << hot[i].first << setw(13) << hot[i].second.runs << setw(11) << hot[i].second.self * ms
+               << setw(11) << hot[i].second.total * ms << "  " << sourceLine(hot[i].first) << endl;
+        }
+
+        if (!bc.labels.empty()) {
+            os << endl << "  label                  line         hits" << endl;
+            for (auto& label : bc.labels) {
+                os << "  " << left << setw(20) << label.name << right << setw(6) << label.line << setw(13)
+                   << profile.counts[label.pc] << endl;
+            }
+        }
+
+        // A loop is a jump back to an earlier instruction: the end of a
+        // loop block, or a goto to a label above it
+        struct Loop {
+            int first, last;
+            uint64_t passes;
+            double cpu;
+        };
+        vector<Loop> loops;
+        for (size_t pc = 0; pc < bc.code.size(); pc++) {
+            const Instr& in = bc.code[pc];
+            bool back = in.op == OP_JUMP || in.op == OP_FOR_STEP || in.op == OP_FOR_STEP_BY;
+            if (!back || (size_t)in.b > pc || !profile.counts[pc]) continue;
+            Loop loop = {INT_MAX, 0, profile.counts[pc], 0};
+            for (size_t at = in.b; at <= pc; at++) {
+                if (!bc.lines[at]) continue;
+                loop.first = min(loop.first, bc.lines[at]);
+                loop.last = max(loop.last, bc.lines[at]);
+            }
+            for (auto& sample : profile.samples) {
+                for (uint32_t at : sample.pcs) {
+                    if (at >= (size_t)in.b && at <= pc) {
+                        loop.cpu += sample.cpu;
+                        break;
+                    }
+                }
+            }
+            if (loop.last) loops.push_back(loop);
+        }
+        stable_sort(loops.begin(), loops.end(), [](const Loop& x, const Loop& y) {
+            return x.cpu != y.cpu ? x.cpu > y.cpu : x.passes > y.passes;
+        });
+        if (!loops.empty()) {
+            os << endl << "  loop lines        passes   total ms" << endl;
+            for (size_t i = 0; i < loops.size() && i < 10; i++) {
+                string range = to_string(loops[i].first) + "-" + to_string(loops[i].last);
+                os << "  " << left << setw(11) << range << right << setw(13) << loops[i].passes << setw(11)
+                   << loops[i].cpu * ms << endl;
+            }
+        }
+        os.flags(flags);
+        os.precision(precision);
+    }
+
+    // One line per distinct stack with its CPU time in microseconds:
+    // "main:12;fib:4;fib:5 3712"
+    bool writeFolded(const string& path) {
+        ofstream file(path);
+        map<string, double> stacks;
+        for (auto& sample : profile.samples) {
+            string stack = sample.truncated ? "..." : "";
+            for (uint32_t pc : sample.pcs) {
+                if (!stack.empty()) stack += ";";
+                stack += frameName(pc) + ":" + to_string(bc.lines[pc]);
+            }
+            stacks[stack] += sample.cpu;
+        }
+        for (auto& [stack, cpu] : stacks) file << stack << " " << llround(cpu * 1e6) << "\n";
+        return (bool)file;
+    }
+
+    // Consecutive samples with the same frames become one complete ("X")
+    // event per frame; each frame is a procedure with its current line
+    // nested inside it. A sample stands for the CPU time just before it.
+    bool writeTrace(const string& path) {
+        ofstream file(path);
+        double slack = 2 * Profile::INTERVAL_US / 1e6;
+        struct Open {
+            string name;
+            double start, last;
+        };
+        vector<Open> open;
+        bool firstEvent = true;
+        auto close = [&](size_t depth) {
+            while (open.size() > depth) {
+                Open& span = open.back();
+                file << (firstEvent ? "\n" : ",\n") << "{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"ts\":"
+                     << (long long)(span.start * 1e6) << ",\"dur\":"
+                     << (long long)((span.last - span.start) * 1e6) << ",\"pid\":1,\"tid\":1}";
+                firstEvent = false;
+                open.pop_back();
+            }
+        };
+
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (auto& sample : profile.samples) {
+            vector<string> names;
+            for (uint32_t pc : sample.pcs) {
+                names.push_back(frameName(pc));
+                names.push_back("line " + to_string(bc.lines[pc]));
+            }
+            // A gap (such as waiting for input) ends everything that was open
+            double from = sample.time - sample.cpu;
+            if (!open.empty() && from - open.back().last > slack) close(0);
+            size_t same = 0;
+            while (same < open.size() && same < names.size() && open[same].name == names[same]) same++;
+            close(same);
+            for (size_t i = 0; i < same; i++) open[i].last = sample.time;
+            for (size_t i = same; i < names.size(); i++) open.push_back({names[i], max(from, 0.0), sample.time});
+        }
+        close(0);
+        file << "\n]}\n";
+        return (bool)file;
+    }
+
+private:
+    // Procedures follow the main program in entry order
+    string frameName(size_t pc) {
+        for (size_t i = bc.procs.size(); i-- > 0;) {
+            if (pc >= (size_t)bc.procs[i].entry) return bc.procs[i].name;
+        }
+        return "main";
+    }
+
+    string sourceLine(int line) {
+        if (line < 1 || (size_t)line > source.size()) return "";
+        string text = source[line - 1];
+        text.erase(0, text.find_first_not_of(" \t"));
+        if (text.size() > 40) text = text.substr(0, 37) + "...";
+        return text;
+    }
+};
+
+#ifndef FLOW_NO_MAIN
+// Runs a compiled program, then reports its profile if one was asked for
+int runProgram(Interpreter& interpreter, const Bytecode& bc, bool profiling, const string& profileOut,
+               string_view source) {
+    Profile profile;
+    if (profiling) interpreter.setProfile(&profile);
+    bool ok = interpreter.run(bc);
+    if (profiling) {
+        ProfileReport report(bc, profile, source);
+        report.writeTable(cerr);
+        bool trace = profileOut.size() > 5 && profileOut.compare(profileOut.size() - 5, 5, ".json") == 0;
+        if (!profileOut.empty() && !(trace ? report.writeTrace(profileOut) : report.writeFolded(profileOut))) {
+            cerr << "Could not write file: " << profileOut << endl;
+        }
+    }
+    return ok ? 0 : interpreter.stoppedByLimit() ? EXIT_LIMIT : 1;
+}
+
+// Runs jobs on a fixed set of threads. Each worker takes jobs from the back
+// of its own queue and, once that is empty, steals from the front of the
+// others', so a worker stuck on one slow job does not hold up the rest.
+class WorkStealingPool {
+    struct Queue {
+        mutex lock;
+        deque<size_t> jobs;
+    };
+    vector<Queue> queues;
+
+    bool next(size_t worker, size_t& job) {
+        {
+            Queue& own = queues[worker];
+            lock_guard<mutex> hold(own.lock);
+            if (!own.jobs.empty()) {
+                job = own.jobs.back();
+                own.jobs.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            Queue& other = queues[(worker + i) % queues.size()];
+            lock_guard<mutex> hold(other.lock);
+            if (!other.jobs.empty()) {
+                job = other.jobs.front();
+                other.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    explicit WorkStealingPool(size_t workers) : queues(max(workers, (size_t)1)) {}
+
+    // Jobs 0..count-1, dealt out round robin so every worker starts busy
+    void add(size_t count) {
+        for (size_t job = 0; job < count; job++) queues[job % queues.size()].jobs.push_back(job);
+    }
+
+    // Calls work(job) for every job, and returns once all are done
+    template <typename F>
+    void run(F work) {
+        vector<thread> threads;
+        for (size_t w = 0; w < queues.size(); w++) {
+            threads.emplace_back([this, w, &work] {
+                size_t job;
+                while (next(w, job)) work(job);
+            });
+        }
+        for (auto& t : threads) t.join();
+    }
+};
+
+// --batch: one line of the manifest and, once run, how it went
+struct BatchJob {
+    string script;
+    string input;   // "" when the job reads no input
+    string output;  // "" when the output is only hashed
+    shared_ptr<const Bytecode> program;  // null if the script could not be loaded
+    string loadErrors;
+    int status = 0;
+    double seconds = 0;
+    uint64_t hash = 0;
+    string errors;
+};
+
+// The settings from the command line that every job shares
+struct BatchSettings {
+    bool optimize;
+    bool unchecked;
+    size_t maxDepth;
+    Limits limits;
+    const char* seed;
+    size_t threads;
+};
+
+// A job's output, kept in memory and charged to heapBytes like the job's
+// own strings, so a job that prints without end is stopped by --max-memory
+// at its next limit check. Never throws: a stream would swallow it.
+class CapturedOutput : public streambuf {
+    string text;
+    size_t charged = 0;
+
+    void charge() {
+        heapBytes += text.capacity() - charged;
+        charged = text.capacity();
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            text.push_back(traits_type::to_char_type(c));
+            charge();
+        }
+        return traits_type::not_eof(c);
+    }
+
+    streamsize xsputn(const char* s, streamsize n) override {
+        text.append(s, (size_t)n);
+        charge();
+        return n;
+    }
+
+public:
+    ~CapturedOutput() override { heapBytes -= charged; }
+
+    const string& str() const { return text; }
+};
+
+// FNV-1a, printed to tell outputs apart at a glance
+uint64_t outputHash(const string& text) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : text) h = (h ^ c) * 0x100000001b3ULL;
+    return h;
+}
+
+// Compiles a script (or loads a .flowc) for the batch; on failure returns
+// null with the reason in errors
+shared_ptr<const Bytecode> loadBatchProgram(const string& path, const BatchSettings& settings, string& errors) {
+    if (path.size() > 6 && path.compare(path.size() - 6, 6, ".flowc") == 0) {
+        Bytecode bc;
+        if (!loadImage(path, bc, errors)) return nullptr;
+        if (bc.unchecked && !settings.unchecked) {
+            errors = path + " was compiled with --unchecked; pass --unchecked to run it";
+            return nullptr;
+        }
+        return make_shared<const Bytecode>(std::move(bc));
+    }
+    SourceFile source;
+    if (!source.open(path)) {
+        errors = "Could not open file: " + path;
+        return nullptr;
+    }
+    ostringstream messages;
+    auto program = compileProgram(source.text(), messages, settings.optimize, false, settings.unchecked);
+    errors = messages.str();
+    return program;
+}
+
+void runBatchJob(BatchJob& job, const BatchSettings& settings) {
+    auto start = chrono::steady_clock::now();
+    CapturedOutput captured;
+    ostream output(&captured);
+    ostringstream errors;
+    errors << job.loadErrors;
+    job.status = 1;
+    ifstream inputFile;
+    istringstream noInput;
+    if (!job.input.empty()) {
+        inputFile.open(job.input);
+        if (!inputFile) errors << "Could not open file: " << job.input << endl;
+    }
+    if (job.program && (job.input.empty() || inputFile)) {
+        Interpreter interpreter;
+        interpreter.setOutput(&output);
+        interpreter.setErrors(&errors);
+        if (job.input.empty()) interpreter.setInput(&noInput, "This job has no input file");
+        else interpreter.setInput(&inputFile, "The input file " + job.input + " has no more input");
+        interpreter.setMaxDepth(settings.maxDepth);
+        interpreter.setUnchecked(settings.unchecked);
+        interpreter.setLimits(settings.limits);
+        if (settings.seed) interpreter.setSeed(strtoull(settings.seed, nullptr, 10));
+        bool ok = interpreter.run(*job.program);
+        job.status = ok ? 0 : interpreter.stoppedByLimit() ? EXIT_LIMIT : 1;
+    }
+    job.hash = outputHash(captured.str());
+    if (!job.output.empty()) {
+        ofstream file(job.output);
+        file << captured.str();
+        if (!file) {
+            errors << "Could not write file: " << job.output << endl;
+            job.status = 1;
+        }
+    }
+    job.errors = errors.str();
+    job.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Runs every job of a manifest, each script compiled only once, and prints
+// a line per job; returns 0 when every job succeeded
+int runBatch(const string& manifestPath, const BatchSettings& settings) {
+    ifstream manifest(manifestPath);
+    if (!manifest) {
+        cerr << "Could not open file: " << manifestPath << endl;
+        return 1;
+    }
+
+    // SCRIPT [INPUT [OUTPUT]] per line; "-" skips the input, # starts a comment
+    vector<BatchJob> jobs;
+    string line;
+    int lineNumber = 0;
+    while (getline(manifest, line)) {
+        lineNumber++;
+        istringstream fields(line.substr(0, line.find('#')));
+        vector<string> words;
+        string word;
+        while (fields >> word) words.push_back(word);
+        if (words.empty()) continue;
+        if (words.size() > 3) {
+            cerr << manifestPath << ":" << lineNumber << ": expected SCRIPT [INPUT [OUTPUT]]" << endl;
+            return 1;
+        }
+        BatchJob job;
+        job.script = words[0];
+        if (words.size() > 1 && words[1] != "-") job.input = words[1];
+        if (words.size() > 2) job.output = words[2];
+        jobs.push_back(std::move(job));
+    }
+
+    // Each distinct script is compiled once, before any job runs
+    map<string, pair<shared_ptr<const Bytecode>, string>> programs;
+    for (auto& job : jobs) {
+        auto found = programs.find(job.script);
+        if (found == programs.end()) {
+            string errors;
+            auto program = loadBatchProgram(job.script, settings, errors);
+            if (!errors.empty() && errors.back() != '\n') errors += '\n';
+            found = programs.emplace(job.script, make_pair(program, errors)).first;
+        }
+        job.program = found->second.first;
+        job.loadErrors = found->second.second;
+    }
+
+    auto start = chrono::steady_clock::now();
+    WorkStealingPool pool(min(settings.threads, jobs.size()));
+    pool.add(jobs.size());
+    pool.run([&](size_t i) { runBatchJob(jobs[i], settings); });
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0, limited = 0;
+    cout << "  job  status  seconds  output            script" << endl;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const BatchJob& job = jobs[i];
+        const char* status = job.status == 0 ? "ok" : job.status == EXIT_LIMIT ? "limit" : "error";
+        if (job.status == EXIT_LIMIT) limited++;
+        else if (job.status != 0) failed++;
+        cout << setw(5) << i + 1 << "  " << left << setw(6) << status << right << "  " << fixed << setprecision(3)
+             << setw(7) << job.seconds << "  " << hex << setfill('0') << setw(16) << job.hash << dec
+             << setfill(' ') << "  " << job.script;
+        if (!job.input.empty()) cout << " < " << job.input;
+        if (!job.output.empty()) cout << " > " << job.output;
+        cout << endl;
+        istringstream errors(job.errors);
+        while (getline(errors, line)) cout << "       | " << line << endl;
+    }
+    cout << jobs.size() << " job(s) from " << programs.size() << " script(s): " << jobs.size() - failed - limited
+         << " ok, " << failed << " failed, " << limited << " stopped by a limit; " << setprecision(3) << seconds
+         << "s on " << min(settings.threads, jobs.size()) << " thread(s)" << endl;
+    return failed || limited ? 1 : 0;
+}
+
+// Whether a REPL entry is ready to run: not while a block is open or a
+// block header (when, repeat, loop, define, otherwise) still waits for its
+// ->, since the -> may be on the next line. A when block that has just
+// closed may still get an otherwise, so the next line decides.
+enum EntryState { ENTRY_READY, ENTRY_OPEN, ENTRY_MAY_CONTINUE };
+
+EntryState entryState(string_view entry) {
+    ostringstream ignored;
+    ostream* outer = diagnostics;
+    diagnostics = &ignored;
+    vector<Token> tokens = Lexer(entry).tokenize();
+    diagnostics = outer;
+
+    int open = 0;          // blocks opened and not yet closed
+    bool header = false;   // a block keyword is waiting for its ->
+    TokenType outermost = TOK_EOF;  // keyword of the top-level block
+    TokenType last = TOK_EOF;       // last token other than a line break
+    for (const Token& token : tokens) {
+        switch (token.type) {
+        case TOK_WHEN: case TOK_OTHERWISE: case TOK_REPEAT: case TOK_LOOP: case TOK_DEFINE:
+            header = true;
+            if (open == 0) outermost = token.type;
+            break;
+        case TOK_ARROW_RIGHT:
+            header = false;
+            open++;
+            break;
+        case TOK_ARROW_LEFT:
+            open--;
+            break;
+        default:
+            break;
+        }
+        if (token.type != TOK_NEWLINE && token.type != TOK_EOF) last = token.type;
+    }
+    if (open > 0 || header) return ENTRY_OPEN;
+    return outermost == TOK_WHEN && last == TOK_ARROW_LEFT ? ENTRY_MAY_CONTINUE : ENTRY_READY;
+}
+
+// --repl: runs statements as they are typed. Each entry (a statement, or
+// a whole block once its last <- is typed) is compiled onto the end of one
+// live program, so variables, procedures and labels carry over and only
+// the new entry is lexed, parsed and compiled.
+int runRepl(Interpreter& interpreter, bool unchecked, bool optimize, bool foldReport) {
+    bool terminal = isatty(STDIN_FILENO);
+    if (terminal) cout << "Flow: type statements to run them, :help for commands, Ctrl-D to quit" << endl;
+
+    // Ctrl-C stops the running entry rather than the session
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onInterrupt;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, nullptr);
+    interpreter.setInterruptible(true);
+
+    Compiler compiler(unchecked);
+    AstArena arena;         // ASTs of the entries, kept for the compiler
+    deque<string> session;  // the entries so far, which the ASTs point into
+    string entry, line;
+    int entryLine = 1;  // session line the entry starts on
+    EntryState state = ENTRY_READY;
+
+    // An entry that does not parse or compile is dropped whole, so the live
+    // program (and what :save writes) only ever gains clean entries
+    auto runEntry = [&] {
+        session.push_back(std::move(entry));
+        entry.clear();
+        const string& source = session.back();
+        ostringstream problems;
+        ostream* outer = diagnostics;
+        diagnostics = &problems;
+        vector<Token> tokens = Lexer(source, entryLine).tokenize();
+        auto ast = Parser(tokens, arena).parse();
+        diagnostics = outer;
+        if (!problems.str().empty()) {
+            cerr << problems.str();
+            session.pop_back();
+            return;
+        }
+        if (optimize) Optimizer(arena, foldReport).optimize(ast);
+        size_t start = compiler.compileMore(ast);
+        if (start == SIZE_MAX) {
+            session.pop_back();
+            return;
+        }
+        interpreter.resume(compiler.program(), start);
+        entryLine += (int)count(source.begin(), source.end(), '\n');
+    };
+
+    for (;;) {
+        if (terminal) cout << (entry.empty() ? "flow> " : "...   ") << flush;
+        if (!getline(cin, line)) break;
+
+        // After a when block, anything but an otherwise runs it first
+        if (state == ENTRY_MAY_CONTINUE) {
+            ostringstream ignored;
+            ostream* outer = diagnostics;
+            diagnostics = &ignored;
+            bool otherwise = Lexer(line).tokenize().front().type == TOK_OTHERWISE;
+            diagnostics = outer;
+            if (!otherwise) {
+                runEntry();
+                state = ENTRY_READY;
+                if (line.find_first_not_of(" \t\r") == string::npos) continue;
+            }
+        }
+
+        if (entry.empty() && !line.empty() && line[0] == ':') {
+            istringstream words(line);
+            string command, path;
+            words >> command >> path;
+            if (command == ":quit") break;
+            if (command == ":list") {
+                for (auto& text : session) cout << text;
+                cout << flush;
+            } else if (command == ":save" && !path.empty()) {
+                ofstream file(path);
+                for (auto& text : session) file << text;
+                if (!file) cerr << "Could not write file: " << path << endl;
+            } else {
+                cout << ":list         show the statements entered so far" << endl;
+                cout << ":save FILE    write them to FILE, to run later with flow FILE" << endl;
+                cout << ":quit         leave (so does Ctrl-D)" << endl;
+            }
+            continue;
+        }
 
+        entry += line;
+        entry += '\n';
+        state = entryState(entry);
+        if (state == ENTRY_READY) runEntry();
+    }
+    if (state == ENTRY_MAY_CONTINUE) runEntry();
+    if (terminal) cout << endl;
     return 0;
 }
+
+int main(int argc, char* argv[]) {
+    bool unbuffered = false;
+    bool screen = false;
+    bool screenStats = false;
+    bool optimize = false;
+    bool foldReport = false;
+    bool compileOnly = false;
+    bool unchecked = false;
+    bool simd = true;
+    bool profiling = false;
+    string profileOut;
+    string recordPath;
+    string replayPath;
+    const char* seed = nullptr;
+    Limits limits;
+    size_t maxDepth = Interpreter::DEFAULT_MAX_DEPTH;
+    const char* batch = nullptr;
+    bool repl = false;
+    bool help = false;
+    size_t threads = max(thread::hardware_concurrency(), 1u);
+    const char* filename = nullptr;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--vm") continue; // the VM is the only engine; accepted for old scripts
+        else if (arg == "-O") optimize = true;
+        else if (arg == "--fold-report") optimize = foldReport = true;
+        else if (arg == "--unbuffered") unbuffered = true;
+        else if (arg == "--screen") screen = true;
+        else if (arg == "--screen-stats") screen = screenStats = true;
+        else if (arg == "--compile") compileOnly = true;
+        else if (arg == "--unchecked") unchecked = true;
+        else if (arg == "--no-simd") simd = false;
+        else if (arg == "--record" && i + 1 < argc) recordPath = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc) replayPath = argv[++i];
+        else if (arg == "--seed" && i + 1 < argc) seed = argv[++i];
+        else if (arg == "--max-steps" && i + 1 < argc) limits.steps = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--max-time" && i + 1 < argc) limits.seconds = strtod(argv[++i], nullptr);
+        else if (arg == "--max-memory" && i + 1 < argc) limits.bytes = strtoull(argv[++i], nullptr, 10) << 20;
+        else if (arg == "--profile") profiling = true;
+        else if (arg == "--profile-out" && i + 1 < argc) profiling = true, profileOut = argv[++i];
+        else if (arg == "--max-depth" && i + 1 < argc) maxDepth = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--batch" && i + 1 < argc) batch = argv[++i];
+        else if (arg == "--repl") repl = true;
+        else if (arg == "--help" || arg == "-h") help = true;
+        else if (arg == "--jobs" && i + 1 < argc) threads = max(strtoul(argv[++i], nullptr, 10), 1ul);
+        else filename = argv[i];
+    }
+
+    selectArrayKernels(simd);
+
+    if (batch) {
+        if (filename || compileOnly || repl || profiling || screen || !recordPath.empty() || !replayPath.empty()) {
+            cerr << "--batch runs the scripts named in its manifest; it cannot be combined with a file name,"
+                 << " --compile, --repl, --profile, --screen, --record or --replay" << endl;
+            return 1;
+        }
+        return runBatch(batch, {optimize, unchecked, maxDepth, limits, seed, threads});
+    }
+
+    if (help || (compileOnly && !filename)) {
+        cerr << "Usage: flow [-O] [--fold-report] [--unbuffered] [--screen] [--screen-stats]" << endl;
+        cerr << "            [--max-depth N] [--unchecked] [--no-simd] [--profile] [--profile-out FILE]" << endl;
+        cerr << "            [--seed N] [--record FILE | --replay FILE]" << endl;
+        cerr << "            [--max-steps N] [--max-time SECONDS] [--max-memory MB] <filename.flow>" << endl;
+        cerr << "       flow --compile [-O] [--unchecked] <filename.flow>    (writes filename.flowc)" << endl;
+        cerr << "       flow --batch MANIFEST [--jobs N] [options]    (runs SCRIPT [INPUT [OUTPUT]] per line)" << endl;
+        cerr << "       flow [--repl] [options]    (no file: type statements and run them one at a time)" << endl;
+        return help ? 0 : 1;
+    }
+
+    Interpreter interpreter(unbuffered, screen, screenStats);
+    interpreter.setMaxDepth(maxDepth);
+    interpreter.setUnchecked(unchecked);
+    if (seed) interpreter.setSeed(strtoull(seed, nullptr, 10));
+    interpreter.setLimits(limits);
+
+    if (repl || !filename) {
+        if (filename || profiling || !recordPath.empty() || !replayPath.empty()) {
+            cerr << "The REPL reads statements as they are typed; it cannot be combined with a file name,"
+                 << " --profile, --record or --replay" << endl;
+            return 1;
+        }
+        return runRepl(interpreter, unchecked, optimize, foldReport);
+    }
+
+    // A replayed session supplies the seed and every line of input
+    istringstream replayInput;
+    ofstream recordLog;
+    if (!replayPath.empty() && !compileOnly) {
+        uint64_t seed = 0;
+        string input, error;
+        if (!loadSession(replayPath, seed, input, error)) {
+            cerr << error << endl;
+            return 1;
+        }
+        interpreter.setSeed(seed);
+        replayInput.str(input);
+        interpreter.setInput(&replayInput);
+    }
+    if (!recordPath.empty() && !compileOnly) {
+        recordLog.open(recordPath);
+        if (!recordLog) {
+            cerr << "Could not write file: " << recordPath << endl;
+            return 1;
+        }
+        recordLog << "# flow session: run again with flow --replay " << recordPath << " " << filename << endl;
+        recordLog << SESSION_SEED << interpreter.getSeed() << endl;
+        interpreter.setRecord(&recordLog);
+    }
+
+    // Precompiled programs skip straight to the VM
+    string path = filename;
+    if (!compileOnly && path.size() > 6 && path.compare(path.size() - 6, 6, ".flowc") == 0) {
+        Bytecode bc;
+        string error;
+        if (!loadImage(path, bc, error)) {
+            cerr << error << endl;
+            return 1;
+        }
+        if (bc.unchecked && !unchecked) {
+            cerr << path << " was compiled with --unchecked; pass --unchecked to run it" << endl;
+            return 1;
+        }
+        return runProgram(interpreter, bc, profiling, profileOut, "");
+    }
+
+    SourceFile file;
+    if (!file.open(filename)) {
+        cerr << "Could not open file: " << filename << endl;
+        return 1;
+    }
+    string_view source = file.text();
+
+    auto program = compileProgram(source, cerr, optimize, foldReport, unchecked);
+
+    if (compileOnly) {
+        string imagePath = path + "c";
+        if (!saveImage(*program, imagePath)) {
+            cerr << "Could not write file: " << imagePath << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Execute
+    return runProgram(interpreter, *program, profiling, profileOut, source);
+}
+#endif